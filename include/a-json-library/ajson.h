@@ -37,11 +37,152 @@ typedef struct ajsona_s ajsona_t;
 struct ajsono_s;
 typedef struct ajsono_s ajsono_t;
 
+typedef struct {
+  const char *key;
+  uint32_t length;
+  uint32_t hash;
+} ajson_key_t;
+
 /* This is the core function for parsing json.  This parser is not fully
  * compliant in that keys are expected to not include encodings (or if they do,
  * then you must encode the keys in the same way to match). */
 ajson_t *ajson_parse(aml_pool_t *pool, char *p, char *ep);
 
+/* AJSON_PARSE_INDEXED parses in two stages.  The first stage classifies the
+   input 64 bytes at a time (with SSE4.2, AVX2, AVX-512, or NEON when
+   available) into a bitmap of unescaped quotes and whitespace.  The second
+   stage is the normal parser, which uses the bitmap to jump to the end of
+   each string and over runs of whitespace instead of scanning one byte at a
+   time.  The resulting tree is identical to ajson_parse. */
+#define AJSON_PARSE_INDEXED 1
+
+/* AJSON_PARSE_CONTIGUOUS_ARRAYS stores the elements of each array in one
+   contiguous block (the ajsona_t nodes followed by the values) instead of
+   allocating every element separately.  ajsona_nth, ajsona_nth_node and
+   ajsona_scan become O(1) without building the direct access table and
+   iterating with ajsona_first/ajsona_next walks memory linearly.  The array
+   falls back to the linked representation if it is appended to or an
+   element other than the first or last is erased. */
+#define AJSON_PARSE_CONTIGUOUS_ARRAYS 2
+
+/* AJSON_PARSE_NON_DESTRUCTIVE leaves the input untouched (so it may be a
+   read-only mapping or a shared buffer, cast to char *).  Strings and numbers
+   reference (pointer, length) slices of the input, and a zero terminated
+   copy is made in the pool the first time ajsonv (or any of the ajson_to_*
+   functions) is called on a value.  Because of that, the first access to
+   a value is not thread safe.  Keys are always copied.  The input must
+   outlive the tree. */
+#define AJSON_PARSE_NON_DESTRUCTIVE 4
+
+/* AJSON_PARSE_NUMBERS converts numbers to binary as they are parsed.
+   Integers which fit are stored as an int64_t and all other numbers as a
+   double (next to the text, which is kept for ajsonv and ajson_dump).
+   ajson_to_int64 and ajson_to_double then return the stored value instead
+   of converting the text on every call.  Each number takes 8 more bytes,
+   and within a contiguous array numbers are referenced instead of being
+   stored inline. */
+#define AJSON_PARSE_NUMBERS 8
+
+/* AJSON_PARSE_VALIDATE_UTF8 rejects keys and strings which are not valid
+   UTF-8 (overlong forms, surrogates, and code points above U+10FFFF are
+   invalid).  Each one is validated (16 or 32 bytes at a time with the
+   selected SIMD kernel) as soon as its end is found, so no separate pass
+   over the input is needed.  An invalid sequence is reported as a parse
+   error positioned at its first byte (see ajson_dump_error). */
+#define AJSON_PARSE_VALIDATE_UTF8 16
+
+/* same as ajson_parse, but with a bitwise OR of AJSON_PARSE_* options */
+ajson_t *ajson_parse2(aml_pool_t *pool, char *p, char *ep, uint32_t options);
+
+/* The incremental parser accepts the input in chunks of any size (for
+   example as it is read from a socket) and builds the same tree that
+   ajson_parse would build from the concatenated input.  Because the chunks
+   are not retained, strings and numbers are copied into the pool.  The
+   parser itself is allocated from the pool, but ajson_parser_destroy must
+   be called to release the buffer used for tokens which span chunks. */
+struct ajson_parser_s;
+typedef struct ajson_parser_s ajson_parser_t;
+
+ajson_parser_t *ajson_parser_init(aml_pool_t *pool);
+
+/* returns false once the input is known to be invalid */
+bool ajson_parser_feed(ajson_parser_t *h, const char *p, size_t length);
+
+/* returns the root or an error (with row, column, and offset set) if the
+   input was invalid or incomplete.  Anything after the root is ignored. */
+ajson_t *ajson_parser_finish(ajson_parser_t *h);
+
+void ajson_parser_destroy(ajson_parser_t *h);
+
+/* Newline delimited json (one document per line).  The input is split into
+   batches at line boundaries and the batches are parsed by num_threads
+   threads (0 for one per cpu), each with its own pool.  options are passed
+   to ajson_parse2.  Blank lines are skipped.  The callback receives each
+   root (or error) along with the byte offset of the line and the pool it
+   was allocated from.  The pool is cleared after the callback returns, so
+   anything which must outlive the callback has to be copied.
+
+   Like ajson_parse, the input is modified and strings point into it.  If
+   ordered is true, the callback is called one line at a time in input
+   order.  Otherwise, it is called concurrently from the worker threads as
+   lines are parsed.  The number of records (non-blank lines) is
+   returned. */
+typedef void (*ajson_ndjson_cb)(ajson_t *json, size_t offset,
+                                aml_pool_t *pool, void *arg);
+
+size_t ajson_ndjson(char *p, char *ep, int num_threads, uint32_t options,
+                    bool ordered, ajson_ndjson_cb cb, void *arg);
+
+/* same as ajson_ndjson, but reads the file in large blocks.  (size_t)-1 is
+   returned if the file cannot be opened. */
+size_t ajson_ndjson_file(const char *filename, int num_threads,
+                         uint32_t options, bool ordered, ajson_ndjson_cb cb,
+                         void *arg);
+
+/* Reads the whole file into the pool and parses it with ajson_parse2.
+   NULL is returned if the file cannot be read. */
+ajson_t *ajson_parse_file(aml_pool_t *pool, const char *filename,
+                          uint32_t options);
+
+/* Maps the file (MAP_PRIVATE, so the bytes ajson_parse writes into the input
+   go to private copy-on-write pages and the file is never modified) and
+   parses it in place, avoiding the copy ajson_parse_file makes.  The
+   strings in the tree point into the mapping, so the tree is only valid
+   until ajson_mmap_destroy.  NULL is returned if the file cannot be
+   mapped. */
+struct ajson_mmap_s;
+typedef struct ajson_mmap_s ajson_mmap_t;
+
+ajson_mmap_t *ajson_parse_mmap(aml_pool_t *pool, const char *filename,
+                               uint32_t options);
+
+/* the root (or error) of the parsed file */
+ajson_t *ajson_mmap_root(ajson_mmap_t *m);
+
+void ajson_mmap_destroy(ajson_mmap_t *m);
+
+/* The vectorized code paths are selected at runtime from the features of the
+   cpu the first time one of them is used, so a single build can run on any
+   x86-64 machine.  The AJSON_SIMD environment variable (scalar, sse4.2,
+   avx2, avx512, or neon) or ajson_set_simd_level can force a lower level
+   for benchmarking.  A level the cpu does not support is lowered to the
+   best one that it does, and the level actually selected is returned.
+
+   The selection is made once and is safe when several threads start parsing
+   at the same time.  ajson_set_simd_level is meant to be called before
+   other threads use the library (or between benchmark runs); a parse which
+   is in progress in another thread may mix the kernels of the two levels. */
+typedef enum {
+  AJSON_SIMD_SCALAR = 0,
+  AJSON_SIMD_SSE42 = 1,
+  AJSON_SIMD_AVX2 = 2,
+  AJSON_SIMD_AVX512 = 3,
+  AJSON_SIMD_NEON = 4
+} ajson_simd_t;
+
+ajson_simd_t ajson_simd_level(void);
+ajson_simd_t ajson_set_simd_level(ajson_simd_t level);
+
 /* If the parse fails, the value returned will be marked such that
  * ajson_error returns true.  If this happens, you can dump it to the screen
  * or to a buffer.
@@ -73,10 +214,63 @@ typedef enum {
    Internally, all json is stored as strings and converted on demand. */
 static inline ajson_type_t ajson_type(ajson_t *j);
 
-/* Dump the json to a file or to a buffer */
+/* Event (SAX style) parsing.  Instead of building a tree, the tokenizer of
+   the incremental parser calls back as each token is found, so a document
+   of any size can be processed in memory proportional to its depth.  Keys
+   and values are passed as slices (not zero terminated and still encoded,
+   see ajson_decode) which are only valid during the callback.  The type of
+   a scalar is one of the types after array.  Any callback may be NULL. */
+typedef struct {
+  void (*start_object)(void *arg);
+  void (*end_object)(void *arg);
+  void (*start_array)(void *arg);
+  void (*end_array)(void *arg);
+  void (*key)(void *arg, const char *key, size_t length);
+  void (*scalar)(void *arg, ajson_type_t type, const char *value,
+                 size_t length);
+} ajson_sax_t;
+
+/* Parses the whole input, returning NULL if it was valid or an error
+   (allocated from the pool, which is otherwise unused). */
+ajson_t *ajson_sax_parse(aml_pool_t *pool, const char *p, const char *ep,
+                         const ajson_sax_t *sax, void *arg);
+
+/* An incremental parser (see ajson_parser_init) which calls back instead of
+   building a tree.  ajson_parser_finish returns NULL if the input was
+   valid. */
+ajson_parser_t *ajson_parser_sax_init(aml_pool_t *pool, const ajson_sax_t *sax,
+                                      void *arg);
+
+/* Dump the json to a file or to a buffer.  ajson_dump produces the same
+   bytes as ajson_dump_to_buffer, collecting them in a buffer which is
+   written to the file in blocks of about 64KB. */
 void ajson_dump(FILE *out, ajson_t *a);
 void ajson_dump_to_buffer(aml_buffer_t *bh, ajson_t *a);
 
+/* The exact length of the output of ajson_dump_to_buffer, computed in one
+   traversal of the tree without writing anything. */
+size_t ajson_serialized_size(ajson_t *a);
+
+/* same output as ajson_dump_to_buffer, but the buffer is grown once (by
+   ajson_serialized_size) and the json is then written without any further
+   checks.  This avoids repeated reallocation when dumping large documents
+   into an empty buffer, at the cost of a second traversal. */
+void ajson_dump_to_buffer_exact(aml_buffer_t *bh, ajson_t *a);
+
+/* Writes indented json (each member or element on its own line, indent
+   spaces per level, and a space after each colon) for debugging and human
+   readers.  Empty objects and arrays are written as {} and [].  If
+   sort_keys is true, the members of each object are written in the byte
+   order of their keys (the tree is not changed). */
+void ajson_dump_pretty_to_buffer(aml_buffer_t *bh, ajson_t *a, size_t indent,
+                                 bool sort_keys);
+
+/* Re-emits the json text from p to ep without the whitespace between
+   tokens, using the structural index of AJSON_PARSE_INDEXED to find the
+   strings, so no tree is built and the input is not modified.  The input
+   is not validated. */
+void ajson_minify_to_buffer(aml_buffer_t *bh, const char *p, const char *ep);
+
 /* Decode encoded json text */
 char *ajson_decode(aml_pool_t *pool, char *s, size_t length);
 
@@ -84,7 +278,10 @@ char *ajson_decode(aml_pool_t *pool, char *s, size_t length);
    allows for binary data to be encoded. */
 char *ajson_decode2(size_t *rlen, aml_pool_t *pool, char *s, size_t length);
 
-/* Encode json text */
+/* Encode json text.  Quotes, backslashes, forward slashes, and control
+   characters are escaped (control characters without a short escape are
+   written as \u00XX).  The result is allocated at its exact size, and s is
+   returned as is if nothing needs escaping and it is zero terminated. */
 char *ajson_encode(aml_pool_t *pool, char *s, size_t length);
 
 /* returns NULL if object, array, or error */
@@ -109,6 +306,12 @@ static inline ajson_t *ajson_null(aml_pool_t *pool);
 static inline ajson_t *ajson_zero(aml_pool_t *pool);
 
 static inline ajson_t *ajson_number(aml_pool_t *pool, ssize_t n);
+static inline ajson_t *ajson_uint64(aml_pool_t *pool, uint64_t n);
+
+/* The shortest text which converts back to n (with a decimal point or an
+   exponent, so it is always a decimal).  JSON cannot represent infinity or
+   nan, so they become null. */
+static inline ajson_t *ajson_double(aml_pool_t *pool, double n);
 static inline ajson_t *ajson_number_string(aml_pool_t *pool, char *s);
 static inline ajson_t *ajson_decimal_string(aml_pool_t *pool, char *s);
 
@@ -179,6 +382,8 @@ static inline char *ajsono_scan_strd(aml_pool_t *pool, ajson_t *j,
   The ajsono_get method is faster than the ajsono_find
   method as it creates a sorted array vs a red black tree (or map).  The
   find/insert methods are useful if you need to lookup keys and insert.
+  The nodes of the tree are allocated when find or insert is first called
+  on an object, so objects which are only read do not pay for them.
 
   ajsono_get/get_node/find will not find items which are appended.
 */
@@ -216,11 +421,297 @@ static inline char *ajsono_find_str(ajson_t *j, const char *key, const char *def
 static inline char *ajsono_find_strd(aml_pool_t *pool, ajson_t *j,
                                      const char *key, const char *default_value);
 
+/* The hget/hfind methods have the same semantics as get/find, but lookup
+   keys using an open addressing hash table which is built in a single pass
+   over the object on first use (rather than sorting the keys or building a
+   tree).  This is a better fit for wide objects which are only queried a few
+   times.  The table is kept up to date by ajsono_insert and ajsono_erase.
+   Like get/find, items which are appended after the table is built will not
+   be found. */
+static inline ajson_t *ajsono_hget(ajson_t *j, const char *key);
+static inline ajsono_t *ajsono_hget_node(ajson_t *j, const char *key);
+
+static inline int ajsono_hget_int(ajson_t *j, const char *key, int default_value);
+static inline int32_t ajsono_hget_int32(ajson_t *j, const char *key, int32_t default_value);
+static inline uint32_t ajsono_hget_uint32(ajson_t *j, const char *key, uint32_t default_value);
+static inline int64_t ajsono_hget_int64(ajson_t *j, const char *key, int64_t default_value);
+static inline uint64_t ajsono_hget_uint64(ajson_t *j, const char *key, uint64_t default_value);
+static inline float ajsono_hget_float(ajson_t *j, const char *key, float default_value);
+static inline double ajsono_hget_double(ajson_t *j, const char *key, double default_value);
+static inline bool ajsono_hget_bool(ajson_t *j, const char *key, bool default_value);
+static inline char *ajsono_hget_str(ajson_t *j, const char *key, const char *default_value);
+static inline char *ajsono_hget_strd(aml_pool_t *pool, ajson_t *j,
+                                     const char *key, const char *default_value);
+
+static inline ajson_t *ajsono_hfind(ajson_t *j, const char *key);
+static inline ajsono_t *ajsono_hfind_node(ajson_t *j, const char *key);
+
+static inline int ajsono_hfind_int(ajson_t *j, const char *key, int default_value);
+static inline int32_t ajsono_hfind_int32(ajson_t *j, const char *key, int32_t default_value);
+static inline uint32_t ajsono_hfind_uint32(ajson_t *j, const char *key, uint32_t default_value);
+static inline int64_t ajsono_hfind_int64(ajson_t *j, const char *key, int64_t default_value);
+static inline uint64_t ajsono_hfind_uint64(ajson_t *j, const char *key, uint64_t default_value);
+static inline float ajsono_hfind_float(ajson_t *j, const char *key, float default_value);
+static inline double ajsono_hfind_double(ajson_t *j, const char *key, double default_value);
+static inline bool ajsono_hfind_bool(ajson_t *j, const char *key, bool default_value);
+static inline char *ajsono_hfind_str(ajson_t *j, const char *key, const char *default_value);
+static inline char *ajsono_hfind_strd(aml_pool_t *pool, ajson_t *j,
+                                      const char *key, const char *default_value);
+
+/* The hash used for object keys */
+static inline uint32_t ajson_hash(const char *s, size_t length);
+
+/* A key handle precomputes the length and hash of a key so that lookups
+   which are repeated many times with the same key (usually across many
+   documents) don't have to recompute them.  The handle refers to key, so key
+   must outlive it.  Every scan/get/find/hget/hfind function has a _k
+   variant which takes a handle.
+
+    static ajson_key_t id_key;
+    if(!id_key.key) id_key = ajson_key("id");
+    int64_t id = ajsono_get_int64_k(j, &id_key, 0);
+*/
+static inline ajson_key_t ajson_key(const char *key);
+
+static inline ajson_t *ajsono_scan_k(ajson_t *j, const ajson_key_t *key);
+static inline ajson_t *ajsono_scanr_k(ajson_t *j, const ajson_key_t *key);
+static inline int ajsono_scan_int_k(ajson_t *j, const ajson_key_t *key, int default_value);
+static inline int32_t ajsono_scan_int32_k(ajson_t *j, const ajson_key_t *key, int32_t default_value);
+static inline uint32_t ajsono_scan_uint32_k(ajson_t *j, const ajson_key_t *key, uint32_t default_value);
+static inline int64_t ajsono_scan_int64_k(ajson_t *j, const ajson_key_t *key, int64_t default_value);
+static inline uint64_t ajsono_scan_uint64_k(ajson_t *j, const ajson_key_t *key, uint64_t default_value);
+static inline float ajsono_scan_float_k(ajson_t *j, const ajson_key_t *key, float default_value);
+static inline double ajsono_scan_double_k(ajson_t *j, const ajson_key_t *key, double default_value);
+static inline bool ajsono_scan_bool_k(ajson_t *j, const ajson_key_t *key, bool default_value);
+static inline char *ajsono_scan_str_k(ajson_t *j, const ajson_key_t *key, const char *default_value);
+static inline char *ajsono_scan_strd_k(aml_pool_t *pool, ajson_t *j,
+                                       const ajson_key_t *key, const char *default_value);
+
+static inline ajson_t *ajsono_get_k(ajson_t *j, const ajson_key_t *key);
+static inline ajsono_t *ajsono_get_node_k(ajson_t *j, const ajson_key_t *key);
+static inline int ajsono_get_int_k(ajson_t *j, const ajson_key_t *key, int default_value);
+static inline int32_t ajsono_get_int32_k(ajson_t *j, const ajson_key_t *key, int32_t default_value);
+static inline uint32_t ajsono_get_uint32_k(ajson_t *j, const ajson_key_t *key, uint32_t default_value);
+static inline int64_t ajsono_get_int64_k(ajson_t *j, const ajson_key_t *key, int64_t default_value);
+static inline uint64_t ajsono_get_uint64_k(ajson_t *j, const ajson_key_t *key, uint64_t default_value);
+static inline float ajsono_get_float_k(ajson_t *j, const ajson_key_t *key, float default_value);
+static inline double ajsono_get_double_k(ajson_t *j, const ajson_key_t *key, double default_value);
+static inline bool ajsono_get_bool_k(ajson_t *j, const ajson_key_t *key, bool default_value);
+static inline char *ajsono_get_str_k(ajson_t *j, const ajson_key_t *key, const char *default_value);
+static inline char *ajsono_get_strd_k(aml_pool_t *pool, ajson_t *j,
+                                      const ajson_key_t *key, const char *default_value);
+
+static inline ajson_t *ajsono_find_k(ajson_t *j, const ajson_key_t *key);
+static inline ajsono_t *ajsono_find_node_k(ajson_t *j, const ajson_key_t *key);
+static inline int ajsono_find_int_k(ajson_t *j, const ajson_key_t *key, int default_value);
+static inline int32_t ajsono_find_int32_k(ajson_t *j, const ajson_key_t *key, int32_t default_value);
+static inline uint32_t ajsono_find_uint32_k(ajson_t *j, const ajson_key_t *key, uint32_t default_value);
+static inline int64_t ajsono_find_int64_k(ajson_t *j, const ajson_key_t *key, int64_t default_value);
+static inline uint64_t ajsono_find_uint64_k(ajson_t *j, const ajson_key_t *key, uint64_t default_value);
+static inline float ajsono_find_float_k(ajson_t *j, const ajson_key_t *key, float default_value);
+static inline double ajsono_find_double_k(ajson_t *j, const ajson_key_t *key, double default_value);
+static inline bool ajsono_find_bool_k(ajson_t *j, const ajson_key_t *key, bool default_value);
+static inline char *ajsono_find_str_k(ajson_t *j, const ajson_key_t *key, const char *default_value);
+static inline char *ajsono_find_strd_k(aml_pool_t *pool, ajson_t *j,
+                                       const ajson_key_t *key, const char *default_value);
+
+static inline ajson_t *ajsono_hget_k(ajson_t *j, const ajson_key_t *key);
+static inline ajsono_t *ajsono_hget_node_k(ajson_t *j, const ajson_key_t *key);
+static inline int ajsono_hget_int_k(ajson_t *j, const ajson_key_t *key, int default_value);
+static inline int32_t ajsono_hget_int32_k(ajson_t *j, const ajson_key_t *key, int32_t default_value);
+static inline uint32_t ajsono_hget_uint32_k(ajson_t *j, const ajson_key_t *key, uint32_t default_value);
+static inline int64_t ajsono_hget_int64_k(ajson_t *j, const ajson_key_t *key, int64_t default_value);
+static inline uint64_t ajsono_hget_uint64_k(ajson_t *j, const ajson_key_t *key, uint64_t default_value);
+static inline float ajsono_hget_float_k(ajson_t *j, const ajson_key_t *key, float default_value);
+static inline double ajsono_hget_double_k(ajson_t *j, const ajson_key_t *key, double default_value);
+static inline bool ajsono_hget_bool_k(ajson_t *j, const ajson_key_t *key, bool default_value);
+static inline char *ajsono_hget_str_k(ajson_t *j, const ajson_key_t *key, const char *default_value);
+static inline char *ajsono_hget_strd_k(aml_pool_t *pool, ajson_t *j,
+                                       const ajson_key_t *key, const char *default_value);
+
+static inline ajson_t *ajsono_hfind_k(ajson_t *j, const ajson_key_t *key);
+static inline ajsono_t *ajsono_hfind_node_k(ajson_t *j, const ajson_key_t *key);
+static inline int ajsono_hfind_int_k(ajson_t *j, const ajson_key_t *key, int default_value);
+static inline int32_t ajsono_hfind_int32_k(ajson_t *j, const ajson_key_t *key, int32_t default_value);
+static inline uint32_t ajsono_hfind_uint32_k(ajson_t *j, const ajson_key_t *key, uint32_t default_value);
+static inline int64_t ajsono_hfind_int64_k(ajson_t *j, const ajson_key_t *key, int64_t default_value);
+static inline uint64_t ajsono_hfind_uint64_k(ajson_t *j, const ajson_key_t *key, uint64_t default_value);
+static inline float ajsono_hfind_float_k(ajson_t *j, const ajson_key_t *key, float default_value);
+static inline double ajsono_hfind_double_k(ajson_t *j, const ajson_key_t *key, double default_value);
+static inline bool ajsono_hfind_bool_k(ajson_t *j, const ajson_key_t *key, bool default_value);
+static inline char *ajsono_hfind_str_k(ajson_t *j, const ajson_key_t *key, const char *default_value);
+static inline char *ajsono_hfind_strd_k(aml_pool_t *pool, ajson_t *j,
+                                        const ajson_key_t *key, const char *default_value);
+
 /* json path functions */
 static inline ajson_t *ajsono_path(aml_pool_t *pool, ajson_t *j, const char *path);
 static inline char *ajsono_pathv(aml_pool_t *pool, ajson_t *j, const char *path);
 static inline char *ajsono_pathd(aml_pool_t *pool, ajson_t *j, const char *path);
 
+/* On demand navigation.  Instead of building the whole tree, ajson_ondemand
+   checks that the brackets and strings of the input are balanced and
+   returns a cursor for the root.  Moving to a member or element scans the
+   text of the parent and skips over the values before it without creating
+   any nodes.  ajson_ondemand_value creates the tree for just the value the
+   cursor is on (in non-destructive mode, so the input is never modified).
+   This is much cheaper than ajson_parse when only a few values of a large
+   document are needed.  Like ajsono_scan, the first matching key is used.
+   The input must outlive the cursors and values. */
+struct ajson_ondemand_s;
+typedef struct ajson_ondemand_s ajson_ondemand_t;
+
+/* returns NULL if the root is not an object or array or the structure is
+   invalid */
+ajson_ondemand_t *ajson_ondemand(aml_pool_t *pool, char *p, char *ep);
+
+ajson_type_t ajson_ondemand_type(ajson_ondemand_t *o);
+
+/* NULL if o is not an object or does not contain the key */
+ajson_ondemand_t *ajson_ondemand_get(ajson_ondemand_t *o, const char *key);
+
+/* NULL if o is not an array or has n or fewer elements */
+ajson_ondemand_t *ajson_ondemand_nth(ajson_ondemand_t *o, size_t n);
+
+/* the same path syntax as ajsono_path */
+ajson_ondemand_t *ajson_ondemand_path(ajson_ondemand_t *o, const char *path);
+
+/* the value the cursor is on (created on the first call).  NULL if o is
+   NULL or the value is malformed. */
+ajson_t *ajson_ondemand_value(ajson_ondemand_t *o);
+
+/* Parses only the given paths (in the ajsono_path syntax) and the objects
+   and arrays leading to them.  Everything else is skipped over the same way
+   ajson_ondemand skips unvisited values, so no nodes are created for it.
+   Array elements before a selected element are replaced with null so that
+   indexes still refer to the same element.  The input is not modified.
+   NULL is returned if the structure of the input is invalid. */
+ajson_t *ajson_parse_projected(aml_pool_t *pool, char *p, char *ep,
+                               const char **paths, size_t num_paths);
+
+/* A flat (tape) representation of a document.  Every value is one or more
+   64-bit words in a single array.  The top 8 bits of a word are the type
+   and the rest is the payload.  An object or array is a start word, its
+   contents, and an end word.  The start word holds the index of the end
+   word (so the whole container can be skipped in one step) and the end
+   word holds the number of members or elements.  An object member is a
+   string word for the key followed by the value.  Strings, numbers, and
+   binary values hold an offset into the string arena, where the text is
+   stored (still encoded, as ajson_parse stores it) after its 32-bit length
+   and followed by a zero.  true, false, and null have no payload.
+
+   Values are referred to by their index in the tape, the root being 0.
+   Because the tape has no pointers, it can be written to disk and read back
+   as is (in the byte order of the machine that wrote it). */
+struct ajson_tape_s;
+typedef struct ajson_tape_s ajson_tape_t;
+
+/* returned when there is no such value */
+#define AJSON_TAPE_NONE ((size_t)-1)
+
+/* Builds the tape directly from the input without creating a tree (the
+   input is not modified).  Only the tape itself is allocated from the pool.
+   NULL is returned if the input is invalid. */
+ajson_tape_t *ajson_tape_parse(aml_pool_t *pool, const char *p,
+                               const char *ep);
+
+/* error if i is out of range */
+static inline ajson_type_t ajson_tape_type(const ajson_tape_t *t, size_t i);
+
+/* the number of members or elements (0 if i is not an object or array) */
+static inline size_t ajson_tape_count(const ajson_tape_t *t, size_t i);
+
+/* Mirror ajsono_get and ajsona_nth, returning the index of the value or
+   AJSON_TAPE_NONE.  Both skip over the values before the one found without
+   descending into them. */
+static inline size_t ajson_tape_get(const ajson_tape_t *t, size_t i,
+                                    const char *key);
+static inline size_t ajson_tape_nth(const ajson_tape_t *t, size_t i,
+                                    size_t n);
+
+/* The first element (or key) of an object or array and the value after i
+   within the same container, or AJSON_TAPE_NONE.  The members of an object
+   are iterated as follows.
+
+   size_t k = ajson_tape_first(t, i);
+   while (k != AJSON_TAPE_NONE) {
+     // k is the key and k+1 is the value
+     k = ajson_tape_next(t, k + 1);
+   }
+*/
+static inline size_t ajson_tape_first(const ajson_tape_t *t, size_t i);
+static inline size_t ajson_tape_next(const ajson_tape_t *t, size_t i);
+
+/* the index after the value at i (and all of its contents) */
+static inline size_t ajson_tape_skip(const ajson_tape_t *t, size_t i);
+
+/* The text of a key, string, number, or binary value (zero terminated) or
+   of true, false, or null.  NULL if i is an object or array. */
+static inline const char *ajson_tape_value(const ajson_tape_t *t, size_t i,
+                                           size_t *length);
+
+/* dumps the value at i the same way as ajson_dump_to_buffer */
+void ajson_tape_dump_to_buffer(aml_buffer_t *bh, const ajson_tape_t *t,
+                               size_t i);
+
+/* Writes the tape to a file or reads one that was written, returning false
+   or NULL on failure.  A tape which is loaded is checked before it is
+   returned (its sizes against the file and every container end, string
+   offset, and string length against the tape), so a truncated or corrupt
+   file is a failure rather than out of bounds reads later. */
+bool ajson_tape_save(FILE *out, const ajson_tape_t *t);
+ajson_tape_t *ajson_tape_load(aml_pool_t *pool, FILE *in);
+
+/* The writer appends json to a buffer directly, without building a tree.
+   It only tracks whether a comma is needed, so it is declared on the stack
+   and nothing is allocated.  The output is byte for byte what
+   ajson_dump_to_buffer would produce for the same tree (keys are written
+   as is, as ajsono_append stores them, and strings are encoded as
+   ajson_encode_str would encode them).
+
+   ajson_writer_t w;
+   ajson_writer_init(&w, bh);
+   ajson_writer_begin_object(&w);
+   ajson_writer_key(&w, "id");
+   ajson_writer_int64(&w, 42);
+   ajson_writer_key(&w, "tags");
+   ajson_writer_begin_array(&w);
+   ajson_writer_str(&w, "a\"b");
+   ajson_writer_end_array(&w);
+   ajson_writer_end_object(&w);
+
+   The calls are not checked, so they must form a valid document. */
+struct ajson_writer_s;
+typedef struct ajson_writer_s ajson_writer_t;
+
+static inline void ajson_writer_init(ajson_writer_t *w, aml_buffer_t *bh);
+
+static inline void ajson_writer_begin_object(ajson_writer_t *w);
+static inline void ajson_writer_end_object(ajson_writer_t *w);
+static inline void ajson_writer_begin_array(ajson_writer_t *w);
+static inline void ajson_writer_end_array(ajson_writer_t *w);
+
+/* the key of the next member of an object (not encoded) */
+static inline void ajson_writer_key(ajson_writer_t *w, const char *key);
+static inline void ajson_writer_key_string(ajson_writer_t *w,
+                                           const char *key, size_t length);
+
+/* strings are encoded (a NULL string is written as null) */
+static inline void ajson_writer_str(ajson_writer_t *w, const char *s);
+static inline void ajson_writer_string(ajson_writer_t *w, const char *s,
+                                       size_t length);
+
+/* numbers are formatted as ajson_number, ajson_uint64, and ajson_double
+   format them (a double which is not finite is written as null) */
+static inline void ajson_writer_int64(ajson_writer_t *w, int64_t n);
+static inline void ajson_writer_uint64(ajson_writer_t *w, uint64_t n);
+static inline void ajson_writer_double(ajson_writer_t *w, double n);
+
+static inline void ajson_writer_bool(ajson_writer_t *w, bool v);
+static inline void ajson_writer_null(ajson_writer_t *w);
+
+/* writes an existing tree (or value) in place of a value */
+static inline void ajson_writer_json(ajson_writer_t *w, ajson_t *j);
+
 #include "a-json-library/impl/ajson.h"
 
 #ifdef __cplusplus
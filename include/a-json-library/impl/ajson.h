@@ -17,6 +17,7 @@ limitations under the License.
 #include "the-macro-library/macro_map.h"
 #include "the-macro-library/macro_bsearch.h"
 #include "the-macro-library/macro_to.h"
+#include <limits.h>
 
 #define AJSON_ERROR 0
 #define AJSON_VALID 1
@@ -31,13 +32,28 @@ limitations under the License.
 #define AJSON_DECIMAL 9
 #define AJSON_TRUE 10
 
+/* flags */
+#define AJSON_SLICE 1 // value is not zero terminated (see _ajson_terminate)
+#define AJSON_INT64 2 // an _ajson_number_t holding the value as an int64_t
+#define AJSON_DOUBLE 4 // an _ajson_number_t holding the value as a double
+
 struct ajson_s {
-  uint32_t type;
+  uint16_t type;
+  uint16_t flags;
   uint32_t length;
   ajson_t *parent;
   char *value;
 };
 
+/* numbers converted by ajson_parse2 (see AJSON_PARSE_NUMBERS) */
+typedef struct {
+  ajson_t json;
+  union {
+    int64_t i;
+    double d;
+  } number;
+} _ajson_number_t;
+
 static inline ajson_type_t ajson_type(ajson_t *j) {
   return (ajson_type_t)(j->type);
 }
@@ -49,17 +65,54 @@ struct ajsona_s {
 };
 
 struct ajsono_s {
-  macro_map_t map;
   char *key;
   ajson_t *value;
   ajsono_t *next;
   ajsono_t *previous;
+  uint32_t key_length;
+  uint32_t hash;
 };
 
+static inline uint32_t ajson_hash(const char *s, size_t length) {
+  uint64_t h = 0x9E3779B97F4A7C15ULL ^ length;
+  uint64_t v;
+  while (length >= 8) {
+    memcpy(&v, s, 8);
+    h = (h ^ v) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+    s += 8;
+    length -= 8;
+  }
+  if (length) {
+    v = 0;
+    memcpy(&v, s, length);
+    h = (h ^ v) * 0xff51afd7ed558ccdULL;
+  }
+  h ^= h >> 29;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 32;
+  return (uint32_t)h;
+}
+
+static inline ajson_key_t ajson_key(const char *key) {
+  ajson_key_t k;
+  size_t length = strlen(key);
+  k.key = key;
+  k.length = length;
+  k.hash = ajson_hash(key, length);
+  return k;
+}
+
+static inline bool _ajson_key_equal(const ajson_key_t *k, const ajsono_t *o) {
+  return k->hash == o->hash && k->length == o->key_length &&
+         !memcmp(k->key, o->key, k->length);
+}
+
 static inline ajson_t *ajson_binary(aml_pool_t *pool, char *s,
                                         size_t length) {
   ajson_t *j = (ajson_t *)aml_pool_alloc(pool, sizeof(ajson_t));
   j->parent = NULL;
+  j->flags = 0;
   j->type = AJSON_BINARY;
   j->value = s;
   j->length = length;
@@ -70,6 +123,7 @@ static inline ajson_t *ajson_string(aml_pool_t *pool, const char *s,
                                         size_t length) {
   ajson_t *j = (ajson_t *)aml_pool_alloc(pool, sizeof(ajson_t));
   j->parent = NULL;
+  j->flags = 0;
   j->type = AJSON_STRING;
   j->value = (char *)s;
   j->length = length;
@@ -81,6 +135,7 @@ static inline ajson_t *ajson_str(aml_pool_t *pool, const char *s) {
     return NULL;
   ajson_t *j = (ajson_t *)aml_pool_alloc(pool, sizeof(ajson_t));
   j->parent = NULL;
+  j->flags = 0;
   j->type = AJSON_STRING;
   j->value = (char *)s;
   j->length = strlen(s);
@@ -95,6 +150,7 @@ static inline ajson_t *ajson_encode_string(aml_pool_t *pool, const char *s, size
 
   ajson_t *j = (ajson_t *)aml_pool_alloc(pool, sizeof(ajson_t));
   j->parent = NULL;
+  j->flags = 0;
   j->type = AJSON_STRING;
   j->value = (char *)v;
   j->length = strlen(v);
@@ -109,6 +165,7 @@ static inline ajson_t *ajson_encode_str(aml_pool_t *pool, const char *s) {
 
   ajson_t *j = (ajson_t *)aml_pool_alloc(pool, sizeof(ajson_t));
   j->parent = NULL;
+  j->flags = 0;
   j->type = AJSON_STRING;
   j->value = (char *)v;
   j->length = strlen(v);
@@ -119,6 +176,7 @@ static inline ajson_t *ajson_encode_str(aml_pool_t *pool, const char *s) {
 static inline ajson_t *ajson_true(aml_pool_t *pool) {
   ajson_t *j = (ajson_t *)aml_pool_alloc(pool, sizeof(ajson_t));
   j->parent = NULL;
+  j->flags = 0;
   j->type = AJSON_TRUE;
   j->value = (char *)"true";
   j->length = 4;
@@ -128,6 +186,7 @@ static inline ajson_t *ajson_true(aml_pool_t *pool) {
 static inline ajson_t *ajson_false(aml_pool_t *pool) {
   ajson_t *j = (ajson_t *)aml_pool_alloc(pool, sizeof(ajson_t));
   j->parent = NULL;
+  j->flags = 0;
   j->type = AJSON_FALSE;
   j->value = (char *)"false";
   j->length = 5;
@@ -137,6 +196,7 @@ static inline ajson_t *ajson_false(aml_pool_t *pool) {
 static inline ajson_t *ajson_null(aml_pool_t *pool) {
   ajson_t *j = (ajson_t *)aml_pool_alloc(pool, sizeof(ajson_t));
   j->parent = NULL;
+  j->flags = 0;
   j->type = AJSON_NULL;
   j->value = (char *)"null";
   j->length = 4;
@@ -146,19 +206,55 @@ static inline ajson_t *ajson_null(aml_pool_t *pool) {
 static inline ajson_t *ajson_zero(aml_pool_t *pool) {
   ajson_t *j = (ajson_t *)aml_pool_alloc(pool, sizeof(ajson_t));
   j->parent = NULL;
+  j->flags = 0;
   j->type = AJSON_ZERO;
   j->value = (char *)"0";
   j->length = 1;
   return j;
 }
 
+/* Write the text of a number followed by a zero and return its length.
+   The integers need 21 bytes and doubles 32 (nothing is written for
+   infinity or nan). */
+size_t _ajson_int64_text(char *dest, int64_t n);
+size_t _ajson_uint64_text(char *dest, uint64_t n);
+size_t _ajson_double_text(char *dest, double n);
+
+/* appends s encoded as ajson_encode would encode it */
+void _ajson_encode_to_buffer(aml_buffer_t *bh, const char *s, size_t length);
+
 static inline ajson_t *ajson_number(aml_pool_t *pool, ssize_t n) {
-  ajson_t *j = (ajson_t *)aml_pool_alloc(pool, sizeof(ajson_t) + 22);
+  ajson_t *j = (ajson_t *)aml_pool_alloc(pool, sizeof(ajson_t) + 21);
   j->parent = NULL;
+  j->flags = 0;
   j->value = (char *)(j + 1);
   j->type = AJSON_NUMBER;
-  snprintf(j->value, 22, "%ld", n);
-  j->length = strlen(j->value);
+  j->length = _ajson_int64_text(j->value, n);
+  return j;
+}
+
+static inline ajson_t *ajson_uint64(aml_pool_t *pool, uint64_t n) {
+  ajson_t *j = (ajson_t *)aml_pool_alloc(pool, sizeof(ajson_t) + 21);
+  j->parent = NULL;
+  j->flags = 0;
+  j->value = (char *)(j + 1);
+  j->type = AJSON_NUMBER;
+  j->length = _ajson_uint64_text(j->value, n);
+  return j;
+}
+
+static inline ajson_t *ajson_double(aml_pool_t *pool, double n) {
+  char buf[32];
+  size_t length = _ajson_double_text(buf, n);
+  if (!length)
+    return ajson_null(pool);
+  ajson_t *j = (ajson_t *)aml_pool_alloc(pool, sizeof(ajson_t) + length + 1);
+  j->parent = NULL;
+  j->flags = 0;
+  j->value = (char *)(j + 1);
+  j->type = AJSON_DECIMAL;
+  memcpy(j->value, buf, length + 1);
+  j->length = length;
   return j;
 }
 
@@ -167,6 +263,7 @@ static inline ajson_t *ajson_number_string(aml_pool_t *pool, char *s) {
   ajson_t *j =
       (ajson_t *)aml_pool_alloc(pool, sizeof(ajson_t) + length + 1);
   j->parent = NULL;
+  j->flags = 0;
   j->value = (char *)(j + 1);
   j->type = AJSON_NUMBER;
   memcpy(j->value, s, length + 1);
@@ -179,6 +276,7 @@ static inline ajson_t *ajson_decimal_string(aml_pool_t *pool, char *s) {
   ajson_t *j =
       (ajson_t *)aml_pool_alloc(pool, sizeof(ajson_t) + length + 1);
   j->parent = NULL;
+  j->flags = 0;
   j->value = (char *)(j + 1);
   j->type = AJSON_DECIMAL;
   memcpy(j->value, s, length + 1);
@@ -186,13 +284,31 @@ static inline ajson_t *ajson_decimal_string(aml_pool_t *pool, char *s) {
   return j;
 }
 
+/* Convert the text of a number (which need not be zero terminated).  false
+   is returned if the whole text is not a number of the expected form (or
+   the integer does not fit), in which case the macro_to_* functions are
+   used instead. */
+bool _ajson_to_double(const char *s, size_t length, double *r);
+bool _ajson_to_int64(const char *s, size_t length, int64_t *r);
+
+/* copies a value parsed with AJSON_PARSE_NON_DESTRUCTIVE into the pool of
+   its parent so that it is zero terminated */
+char *_ajson_terminate(ajson_t *j);
+
+static inline char *ajsonv(ajson_t *j) {
+  if (j && j->type >= AJSON_STRING)
+    return (j->flags & AJSON_SLICE) ? _ajson_terminate(j) : j->value;
+  else
+    return NULL;
+}
+
 static inline char *ajsond(aml_pool_t *pool, ajson_t *j) {
   if (!j)
     return NULL;
   else if (j->type == AJSON_STRING)
-    return ajson_decode(pool, j->value, j->length);
+    return ajson_decode(pool, ajsonv(j), j->length);
   else if (j->type > AJSON_STRING)
-    return j->value;
+    return ajsonv(j);
   else
     return NULL;
 }
@@ -205,34 +321,56 @@ static inline char *ajsonb(ajson_t *j, size_t *length) {
     return NULL;
 }
 
-static inline char *ajsonv(ajson_t *j) {
-  if (j && j->type >= AJSON_STRING)
-    return j->value;
-  else
-    return NULL;
+/* keys are ordered by hash, then length, then bytes so that most
+   comparisons are decided without touching the key itself */
+static inline int ajsono_key_compare(const char *a, uint32_t alen,
+                                     uint32_t ahash, const ajsono_t *b) {
+  if (ahash != b->hash)
+    return ahash < b->hash ? -1 : 1;
+  if (alen != b->key_length)
+    return alen < b->key_length ? -1 : 1;
+  return memcmp(a, b->key, alen);
 }
 
-static inline int ajsono_compare(const char *key, const ajsono_t **o) {
-  return strcmp(key, (*o)->key);
+static inline int ajsono_compare(const ajson_key_t *key, const ajsono_t **o) {
+  return ajsono_key_compare(key->key, key->length, key->hash, *o);
 }
 
-static inline int ajsono_compare2(const char *key, const ajsono_t *o) {
-  return strcmp(key, o->key);
+static inline int ajsono_compare2(const ajson_key_t *key, const ajsono_t *o) {
+  return ajsono_key_compare(key->key, key->length, key->hash, o);
 }
 
 static inline int ajsono_insert_compare(const ajsono_t *a,
                                           const ajsono_t *b) {
-  return strcmp(a->key, b->key);
+  return ajsono_key_compare(a->key, a->key_length, a->hash, b);
+}
+
+/* Most objects are only read (or only appended to), so the nodes of the
+   tree used by ajsono_find and ajsono_insert are not part of ajsono_t.  They
+   are allocated when the tree is first built. */
+typedef struct {
+  macro_map_t map;
+  ajsono_t *node;
+} _ajsono_map_t;
+
+static inline int _ajsono_map_compare(const ajson_key_t *key,
+                                      const _ajsono_map_t *m) {
+  return ajsono_compare2(key, m->node);
+}
+
+static inline int _ajsono_map_insert_compare(const _ajsono_map_t *a,
+                                             const _ajsono_map_t *b) {
+  return ajsono_insert_compare(a->node, b->node);
 }
 
 static inline
-macro_map_find_kv(__ajson_find, char, ajsono_t,
-                  ajsono_compare2);
+macro_map_find_kv(__ajson_find, ajson_key_t, _ajsono_map_t,
+                  _ajsono_map_compare);
 
-static inline macro_map_insert(__ajson_insert, ajsono_t,
-                                  ajsono_insert_compare);
+static inline macro_map_insert(__ajson_insert, _ajsono_map_t,
+                                  _ajsono_map_insert_compare);
 
-static inline macro_bsearch_first_kv(__ajson_search, char, ajsono_t *,
+static inline macro_bsearch_first_kv(__ajson_search, ajson_key_t, ajsono_t *,
                                   ajsono_compare);
 
 struct ajson_error_s;
@@ -242,12 +380,17 @@ struct _ajsono_s;
 typedef struct _ajsono_s _ajsono_t;
 
 struct ajson_error_s {
-  uint32_t type;
+  uint16_t type;
+  uint16_t flags;
   uint16_t line; // for debug lines see AJSON_DEBUG block (defaults to zero)
   uint16_t line2;
   char *error_at;
   char *source;
   aml_pool_t *pool;
+  // if source is NULL (the input was not contiguous), the position is here
+  size_t row;
+  size_t column;
+  size_t offset;
 };
 
 static inline bool ajson_is_error(ajson_t *j) {
@@ -262,8 +405,20 @@ static inline bool ajson_is_array(ajson_t *j) {
   return j->type == AJSON_ARRAY;
 }
 
+typedef struct {
+  ajsono_t *node;
+  uint32_t hash;
+} _ajsono_hash_slot_t;
+
+typedef struct {
+  uint32_t mask;
+  uint32_t num_entries;
+  _ajsono_hash_slot_t *slots;
+} _ajsono_hash_t;
+
 struct _ajsono_s {
-  uint32_t type;
+  uint16_t type;
+  uint16_t flags;
   uint32_t num_entries;
   ajson_t *parent;
   macro_map_t *root;
@@ -271,13 +426,16 @@ struct _ajsono_s {
   ajsono_t *head;
   ajsono_t *tail;
   aml_pool_t *pool;
+  _ajsono_hash_t *hash;
 };
 
 typedef struct {
-  uint32_t type;
+  uint16_t type;
+  uint16_t flags;
   uint32_t num_entries;
   ajson_t *parent;
   ajsona_t **array;
+  ajsona_t *nodes;
   ajsona_t *head;
   ajsona_t *tail;
   aml_pool_t *pool;
@@ -313,6 +471,8 @@ static inline ajson_t *ajsona_nth(ajson_t *j, int nth) {
   _ajsona_t *arr = (_ajsona_t *)j;
   if (nth >= arr->num_entries)
     return NULL;
+  if (arr->nodes)
+    return arr->nodes[nth].value;
   if (!arr->array)
     _ajsona_fill(arr);
   return arr->array[nth]->value;
@@ -322,6 +482,8 @@ static inline ajsona_t *ajsona_nth_node(ajson_t *j, int nth) {
   _ajsona_t *arr = (_ajsona_t *)j;
   if (nth >= arr->num_entries)
     return NULL;
+  if (arr->nodes)
+    return arr->nodes + nth;
   if (!arr->array)
     _ajsona_fill(arr);
   return arr->array[nth];
@@ -331,6 +493,8 @@ static inline ajson_t *ajsona_scan(ajson_t *j, int nth) {
   _ajsona_t *arr = (_ajsona_t *)j;
   if (nth >= arr->num_entries)
     return NULL;
+  if (arr->nodes)
+    return arr->nodes[nth].value;
   if ((nth << 1) > arr->num_entries) {
     nth = arr->num_entries - nth;
     nth--;
@@ -361,6 +525,7 @@ static inline void ajsona_append(ajson_t *j, ajson_t *item) {
   n->next = NULL;
   arr->num_entries++;
   arr->array = NULL;
+  arr->nodes = NULL;
   if (arr->head) {
     n->previous = arr->tail;
     arr->tail->next = n;
@@ -401,6 +566,7 @@ static inline void ajsona_erase(ajsona_t *n) {
     if (n->next) {
       n->next->previous = n->previous;
       arr->array = NULL;
+      arr->nodes = NULL;
     } else
       arr->tail = n->previous;
   } else {
@@ -409,9 +575,12 @@ static inline void ajsona_erase(ajsona_t *n) {
       n->next->previous = NULL;
       if (arr->array)
         arr->array++;
+      if (arr->nodes)
+        arr->nodes++;
     } else {
       arr->head = arr->tail = NULL;
       arr->array = NULL;
+      arr->nodes = NULL;
     }
   }
 }
@@ -443,15 +612,27 @@ static inline ajsono_t *ajsono_previous(ajsono_t *j) {
   return j->previous;
 }
 
+static inline void _ajsono_hash_erase(_ajsono_hash_t *h, ajsono_t *n);
+
 static inline void ajsono_erase(ajsono_t *n) {
   _ajsono_t *o = (_ajsono_t *)(n->value->parent);
   o->num_entries--;
+  if (o->hash)
+    _ajsono_hash_erase(o->hash, n);
   if (o->root) {
     if (o->num_sorted_entries) {
       o->root = NULL;
       o->num_sorted_entries = 0;
-    } else
-      macro_map_erase(&o->root, (macro_map_t *)n);
+    } else {
+      ajson_key_t k;
+      k.key = n->key;
+      k.length = n->key_length;
+      k.hash = n->hash;
+      /* a duplicate key was never inserted into the tree */
+      _ajsono_map_t *m = __ajson_find(o->root, &k);
+      if (m && m->node == n)
+        macro_map_erase(&o->root, (macro_map_t *)m);
+    }
   }
   if (n->previous) {
     n->previous->next = n->next;
@@ -470,7 +651,7 @@ static inline void ajsono_erase(ajsono_t *n) {
 
 void _ajsono_fill(_ajsono_t *o);
 
-static inline ajsono_t *ajsono_get_node(ajson_t *j, const char *key) {
+static inline ajsono_t *ajsono_get_node_k(ajson_t *j, const ajson_key_t *key) {
   _ajsono_t *o = (_ajsono_t *)j;
   if (!o->root) {
     if (o->head)
@@ -478,80 +659,152 @@ static inline ajsono_t *ajsono_get_node(ajson_t *j, const char *key) {
     else
       return NULL;
   }
-  ajsono_t **res = __ajson_search((char *)key, (const ajsono_t **)o->root,
+  ajsono_t **res = __ajson_search(key, (const ajsono_t **)o->root,
                                       o->num_sorted_entries);
-  return *res;
+  return res ? *res : NULL;
 }
 
-static inline ajson_t *ajsono_get(ajson_t *j, const char *key) {
-  _ajsono_t *o = (_ajsono_t *)j;
-  if (!o->root) {
-    if (o->head)
-      _ajsono_fill(o);
-    else
-      return NULL;
-  }
-  ajsono_t **res = __ajson_search(key, (const ajsono_t **)o->root,
-                                      o->num_sorted_entries);
-  if (res) {
-    ajsono_t *r = *res;
-    if (r)
-      return r->value;
-  }
+static inline ajson_t *ajsono_get_k(ajson_t *j, const ajson_key_t *key) {
+  ajsono_t *r = ajsono_get_node_k(j, key);
+  if (r)
+    return r->value;
   return NULL;
 }
 
-static inline ajson_t *ajsono_scanr(ajson_t *j, const char *key) {
+static inline ajsono_t *ajsono_get_node(ajson_t *j, const char *key) {
+  ajson_key_t k = ajson_key(key);
+  return ajsono_get_node_k(j, &k);
+}
+
+static inline ajson_t *ajsono_get(ajson_t *j, const char *key) {
+  ajson_key_t k = ajson_key(key);
+  return ajsono_get_k(j, &k);
+}
+
+static inline ajson_t *ajsono_scanr_k(ajson_t *j, const ajson_key_t *key) {
   if (!j || j->type != AJSON_OBJECT)
     return NULL;
   _ajsono_t *o = (_ajsono_t *)j;
   ajsono_t *r = o->tail;
   while (r) {
-    if (!strcmp(r->key, key))
+    if (_ajson_key_equal(key, r))
       return r->value;
     r = r->previous;
   }
   return NULL;
 }
 
-static inline ajson_t *ajsono_scan(ajson_t *j, const char *key) {
+static inline ajson_t *ajsono_scan_k(ajson_t *j, const ajson_key_t *key) {
   if (!j || j->type != AJSON_OBJECT)
     return NULL;
   _ajsono_t *o = (_ajsono_t *)j;
   ajsono_t *r = o->head;
   while (r) {
-    if (!strcmp(r->key, key))
+    if (_ajson_key_equal(key, r))
       return r->value;
     r = r->next;
   }
   return NULL;
 }
 
+static inline ajson_t *ajsono_scanr(ajson_t *j, const char *key) {
+  if (!j || j->type != AJSON_OBJECT)
+    return NULL;
+  ajson_key_t k = ajson_key(key);
+  return ajsono_scanr_k(j, &k);
+}
+
+static inline ajson_t *ajsono_scan(ajson_t *j, const char *key) {
+  if (!j || j->type != AJSON_OBJECT)
+    return NULL;
+  ajson_key_t k = ajson_key(key);
+  return ajsono_scan_k(j, &k);
+}
+
+/* The value of a number as an int64_t (or double), taken from the value
+   cached by AJSON_PARSE_NUMBERS or converted from its text.  The ajson_to_*
+   functions use it when the value is in the range of the type and fall back
+   to macro_to_* otherwise, so the results do not change. */
+static inline bool _ajson_number_int64(ajson_t *j, int64_t *r) {
+    if (!j || j->type < AJSON_ZERO || j->type > AJSON_DECIMAL)
+        return false;
+    if (j->flags & AJSON_INT64) {
+        *r = ((_ajson_number_t *)j)->number.i;
+        return true;
+    }
+    if (j->flags & AJSON_DOUBLE)
+        return false;
+    return _ajson_to_int64(j->value, j->length, r);
+}
+
+static inline bool _ajson_number_double(ajson_t *j, double *r) {
+    if (!j || j->type < AJSON_ZERO || j->type > AJSON_DECIMAL)
+        return false;
+    if (j->flags & AJSON_DOUBLE) {
+        *r = ((_ajson_number_t *)j)->number.d;
+        return true;
+    }
+    if (j->flags & AJSON_INT64) {
+        *r = (double)((_ajson_number_t *)j)->number.i;
+        return true;
+    }
+    return _ajson_to_double(j->value, j->length, r);
+}
+
 static inline int ajson_to_int(ajson_t *j, int default_value) {
+    int64_t r;
+    if (_ajson_number_int64(j, &r) && r >= INT_MIN && r <= INT_MAX)
+        return (int)r;
     return macro_to_int(ajsonv(j), default_value);
 }
 
 static inline int32_t ajson_to_int32(ajson_t *j, int32_t default_value) {
+    int64_t r;
+    if (_ajson_number_int64(j, &r) && r >= INT32_MIN && r <= INT32_MAX)
+        return (int32_t)r;
     return macro_to_int32(ajsonv(j), default_value);
 }
 
 static inline uint32_t ajson_to_uint32(ajson_t *j, uint32_t default_value) {
+    int64_t r;
+    if (_ajson_number_int64(j, &r) && r >= 0 && r <= UINT32_MAX)
+        return (uint32_t)r;
     return macro_to_uint32(ajsonv(j), default_value);
 }
 
 static inline int64_t ajson_to_int64(ajson_t *j, int64_t default_value) {
+    int64_t r;
+    if (_ajson_number_int64(j, &r))
+        return r;
     return macro_to_int64(ajsonv(j), default_value);
 }
 
 static inline uint64_t ajson_to_uint64(ajson_t *j, uint64_t default_value) {
+    int64_t r;
+    if (_ajson_number_int64(j, &r) && r >= 0)
+        return (uint64_t)r;
     return macro_to_uint64(ajsonv(j), default_value);
 }
 
+/* A cached integer converts to the same float as its text.  A cached
+   double is rounded a second time, which can differ from converting the
+   text directly by one unit in the last place (only for decimals within a
+   hair of halfway between two floats).  Text is always converted by
+   macro_to_float. */
 static inline float ajson_to_float(ajson_t *j, float default_value) {
+    if (j && j->type >= AJSON_ZERO && j->type <= AJSON_DECIMAL) {
+        if (j->flags & AJSON_DOUBLE)
+            return (float)((_ajson_number_t *)j)->number.d;
+        if (j->flags & AJSON_INT64)
+            return (float)((_ajson_number_t *)j)->number.i;
+    }
     return macro_to_float(ajsonv(j), default_value);
 }
 
 static inline double ajson_to_double(ajson_t *j, double default_value) {
+    double r;
+    if (_ajson_number_double(j, &r))
+        return r;
     return macro_to_double(ajsonv(j), default_value);
 }
 
@@ -695,16 +948,20 @@ static inline char *ajsono_find_strd(aml_pool_t *pool, ajson_t *j, const char *k
 
 
 static inline void _ajsono_fill_tree(_ajsono_t *o) {
+  _ajsono_map_t *m = (_ajsono_map_t *)aml_pool_alloc(
+      o->pool, sizeof(_ajsono_map_t) * o->num_entries);
   ajsono_t *r = o->head;
   o->root = NULL;
   o->num_sorted_entries = 0;
   while (r) {
-    __ajson_insert(&(o->root), r);
+    m->node = r;
+    __ajson_insert(&(o->root), m);
+    m++;
     r = r->next;
   }
 }
 
-static inline ajsono_t *ajsono_find_node(ajson_t *j, const char *key) {
+static inline ajsono_t *ajsono_find_node_k(ajson_t *j, const ajson_key_t *key) {
   _ajsono_t *o = (_ajsono_t *)j;
   if (!o->root || o->num_sorted_entries) {
     if (o->head)
@@ -712,16 +969,29 @@ static inline ajsono_t *ajsono_find_node(ajson_t *j, const char *key) {
     else
       return NULL;
   }
-  return __ajson_find(o->root, key);
+  _ajsono_map_t *m = __ajson_find(o->root, key);
+  return m ? m->node : NULL;
 }
 
-static inline ajson_t *ajsono_find(ajson_t *j, const char *key) {
-  ajsono_t *r = ajsono_find_node(j, key);
+static inline ajson_t *ajsono_find_k(ajson_t *j, const ajson_key_t *key) {
+  ajsono_t *r = ajsono_find_node_k(j, key);
   if (r)
     return r->value;
   return NULL;
 }
 
+static inline ajsono_t *ajsono_find_node(ajson_t *j, const char *key) {
+  ajson_key_t k = ajson_key(key);
+  return ajsono_find_node_k(j, &k);
+}
+
+static inline ajson_t *ajsono_find(ajson_t *j, const char *key) {
+  ajson_key_t k = ajson_key(key);
+  return ajsono_find_k(j, &k);
+}
+
+void _ajsono_hash_add(_ajsono_t *o, ajsono_t *n);
+
 static inline ajsono_t *ajsono_insert(ajson_t *j, const char *key,
                                           ajson_t *item, bool copy_key) {
   if (!item)
@@ -733,27 +1003,196 @@ static inline ajsono_t *ajsono_insert(ajson_t *j, const char *key,
   } else {
     ajsono_append(j, key, item, copy_key);
     _ajsono_t *o = (_ajsono_t *)j;
-    __ajson_insert(&(o->root), o->tail);
+    _ajsono_map_t *m =
+        (_ajsono_map_t *)aml_pool_alloc(o->pool, sizeof(_ajsono_map_t));
+    m->node = o->tail;
+    __ajson_insert(&(o->root), m);
+    if (o->hash)
+      _ajsono_hash_add(o, o->tail);
   }
   return res;
 }
 
-static inline void ajsono_append(ajson_t *j, const char *key,
-                                   ajson_t *item, bool copy_key) {
-  if (!item)
-    return;
+void _ajsono_fill_hash(_ajsono_t *o);
 
+static inline ajsono_t *_ajsono_hash_find(_ajsono_hash_t *h,
+                                          const ajson_key_t *k) {
+  _ajsono_hash_slot_t *slots = h->slots;
+  uint32_t i = k->hash & h->mask;
+  while (slots[i].node) {
+    if (slots[i].hash == k->hash && _ajson_key_equal(k, slots[i].node))
+      return slots[i].node;
+    i = (i + 1) & h->mask;
+  }
+  return NULL;
+}
+
+/* remove n using backward shift deletion so no tombstones are needed */
+static inline void _ajsono_hash_erase(_ajsono_hash_t *h, ajsono_t *n) {
+  _ajsono_hash_slot_t *slots = h->slots;
+  uint32_t i = n->hash & h->mask;
+  while (slots[i].node != n) {
+    if (!slots[i].node)
+      return;
+    i = (i + 1) & h->mask;
+  }
+  uint32_t j = i;
+  for (;;) {
+    j = (j + 1) & h->mask;
+    if (!slots[j].node)
+      break;
+    uint32_t k = slots[j].hash & h->mask;
+    if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+      continue;
+    slots[i] = slots[j];
+    i = j;
+  }
+  slots[i].node = NULL;
+  h->num_entries--;
+}
+
+static inline ajsono_t *ajsono_hfind_node_k(ajson_t *j, const ajson_key_t *key) {
+  _ajsono_t *o = (_ajsono_t *)j;
+  if (!o->hash) {
+    if (o->head)
+      _ajsono_fill_hash(o);
+    else
+      return NULL;
+  }
+  return _ajsono_hash_find(o->hash, key);
+}
+
+static inline ajson_t *ajsono_hfind_k(ajson_t *j, const ajson_key_t *key) {
+  ajsono_t *r = ajsono_hfind_node_k(j, key);
+  if (r)
+    return r->value;
+  return NULL;
+}
+
+static inline ajsono_t *ajsono_hget_node_k(ajson_t *j, const ajson_key_t *key) {
+  return ajsono_hfind_node_k(j, key);
+}
+
+static inline ajson_t *ajsono_hget_k(ajson_t *j, const ajson_key_t *key) {
+  return ajsono_hfind_k(j, key);
+}
+
+static inline ajsono_t *ajsono_hfind_node(ajson_t *j, const char *key) {
+  ajson_key_t k = ajson_key(key);
+  return ajsono_hfind_node_k(j, &k);
+}
+
+static inline ajson_t *ajsono_hfind(ajson_t *j, const char *key) {
+  ajson_key_t k = ajson_key(key);
+  return ajsono_hfind_k(j, &k);
+}
+
+static inline ajsono_t *ajsono_hget_node(ajson_t *j, const char *key) {
+  return ajsono_hfind_node(j, key);
+}
+
+static inline ajson_t *ajsono_hget(ajson_t *j, const char *key) {
+  return ajsono_hfind(j, key);
+}
+
+static inline int ajsono_hget_int(ajson_t *j, const char *key, int default_value) {
+    return ajson_to_int(ajsono_hget(j, key), default_value);
+}
+
+static inline int32_t ajsono_hget_int32(ajson_t *j, const char *key, int32_t default_value) {
+    return ajson_to_int32(ajsono_hget(j, key), default_value);
+}
+
+static inline uint32_t ajsono_hget_uint32(ajson_t *j, const char *key, uint32_t default_value) {
+    return ajson_to_uint32(ajsono_hget(j, key), default_value);
+}
+
+static inline int64_t ajsono_hget_int64(ajson_t *j, const char *key, int64_t default_value) {
+    return ajson_to_int64(ajsono_hget(j, key), default_value);
+}
+
+static inline uint64_t ajsono_hget_uint64(ajson_t *j, const char *key, uint64_t default_value) {
+    return ajson_to_uint64(ajsono_hget(j, key), default_value);
+}
+
+static inline float ajsono_hget_float(ajson_t *j, const char *key, float default_value) {
+    return ajson_to_float(ajsono_hget(j, key), default_value);
+}
+
+static inline double ajsono_hget_double(ajson_t *j, const char *key, double default_value) {
+    return ajson_to_double(ajsono_hget(j, key), default_value);
+}
+
+static inline bool ajsono_hget_bool(ajson_t *j, const char *key, bool default_value) {
+    return ajson_to_bool(ajsono_hget(j, key), default_value);
+}
+
+static inline char *ajsono_hget_str(ajson_t *j, const char *key, const char *default_value) {
+    return ajson_to_str(ajsono_hget(j, key), default_value);
+}
+
+static inline char *ajsono_hget_strd(aml_pool_t *pool, ajson_t *j, const char *key, const char *default_value) {
+    return ajson_to_strd(pool, ajsono_hget(j, key), default_value);
+}
+
+
+static inline int ajsono_hfind_int(ajson_t *j, const char *key, int default_value) {
+    return ajson_to_int(ajsono_hfind(j, key), default_value);
+}
+
+static inline int32_t ajsono_hfind_int32(ajson_t *j, const char *key, int32_t default_value) {
+    return ajson_to_int32(ajsono_hfind(j, key), default_value);
+}
+
+static inline uint32_t ajsono_hfind_uint32(ajson_t *j, const char *key, uint32_t default_value) {
+    return ajson_to_uint32(ajsono_hfind(j, key), default_value);
+}
+
+static inline int64_t ajsono_hfind_int64(ajson_t *j, const char *key, int64_t default_value) {
+    return ajson_to_int64(ajsono_hfind(j, key), default_value);
+}
+
+static inline uint64_t ajsono_hfind_uint64(ajson_t *j, const char *key, uint64_t default_value) {
+    return ajson_to_uint64(ajsono_hfind(j, key), default_value);
+}
+
+static inline float ajsono_hfind_float(ajson_t *j, const char *key, float default_value) {
+    return ajson_to_float(ajsono_hfind(j, key), default_value);
+}
+
+static inline double ajsono_hfind_double(ajson_t *j, const char *key, double default_value) {
+    return ajson_to_double(ajsono_hfind(j, key), default_value);
+}
+
+static inline bool ajsono_hfind_bool(ajson_t *j, const char *key, bool default_value) {
+    return ajson_to_bool(ajsono_hfind(j, key), default_value);
+}
+
+static inline char *ajsono_hfind_str(ajson_t *j, const char *key, const char *default_value) {
+    return ajson_to_str(ajsono_hfind(j, key), default_value);
+}
+
+static inline char *ajsono_hfind_strd(aml_pool_t *pool, ajson_t *j, const char *key, const char *default_value) {
+    return ajson_to_strd(pool, ajsono_hfind(j, key), default_value);
+}
+
+
+static inline void _ajsono_append(ajson_t *j, const char *key,
+                                  uint32_t key_length, uint32_t hash,
+                                  ajson_t *item, bool copy_key) {
   _ajsono_t *o = (_ajsono_t *)j;
   ajsono_t *on;
   if (copy_key) {
     on = (ajsono_t *)aml_pool_zalloc(o->pool,
-                                      sizeof(ajsono_t) + strlen(key) + 1);
+                                      sizeof(ajsono_t) + key_length + 1);
     on->key = (char *)(on + 1);
-    strcpy(on->key, key);
+    memcpy(on->key, key, key_length + 1);
   } else {
     on = (ajsono_t *)aml_pool_zalloc(o->pool, sizeof(ajsono_t));
     on->key = (char *)key;
   }
+  on->key_length = key_length;
+  on->hash = hash;
   on->value = item;
   item->parent = j;
 
@@ -767,6 +1206,220 @@ static inline void ajsono_append(ajson_t *j, const char *key,
   }
 }
 
+static inline void ajsono_append(ajson_t *j, const char *key,
+                                   ajson_t *item, bool copy_key) {
+  if (!item)
+    return;
+  size_t key_length = strlen(key);
+  _ajsono_append(j, key, key_length, ajson_hash(key, key_length), item,
+                 copy_key);
+}
+
+static inline int ajsono_scan_int_k(ajson_t *j, const ajson_key_t *key, int default_value) {
+    return ajson_to_int(ajsono_scan_k(j, key), default_value);
+}
+
+static inline int32_t ajsono_scan_int32_k(ajson_t *j, const ajson_key_t *key, int32_t default_value) {
+    return ajson_to_int32(ajsono_scan_k(j, key), default_value);
+}
+
+static inline uint32_t ajsono_scan_uint32_k(ajson_t *j, const ajson_key_t *key, uint32_t default_value) {
+    return ajson_to_uint32(ajsono_scan_k(j, key), default_value);
+}
+
+static inline int64_t ajsono_scan_int64_k(ajson_t *j, const ajson_key_t *key, int64_t default_value) {
+    return ajson_to_int64(ajsono_scan_k(j, key), default_value);
+}
+
+static inline uint64_t ajsono_scan_uint64_k(ajson_t *j, const ajson_key_t *key, uint64_t default_value) {
+    return ajson_to_uint64(ajsono_scan_k(j, key), default_value);
+}
+
+static inline float ajsono_scan_float_k(ajson_t *j, const ajson_key_t *key, float default_value) {
+    return ajson_to_float(ajsono_scan_k(j, key), default_value);
+}
+
+static inline double ajsono_scan_double_k(ajson_t *j, const ajson_key_t *key, double default_value) {
+    return ajson_to_double(ajsono_scan_k(j, key), default_value);
+}
+
+static inline bool ajsono_scan_bool_k(ajson_t *j, const ajson_key_t *key, bool default_value) {
+    return ajson_to_bool(ajsono_scan_k(j, key), default_value);
+}
+
+static inline char *ajsono_scan_str_k(ajson_t *j, const ajson_key_t *key, const char *default_value) {
+    return ajson_to_str(ajsono_scan_k(j, key), default_value);
+}
+
+static inline char *ajsono_scan_strd_k(aml_pool_t *pool, ajson_t *j, const ajson_key_t *key, const char *default_value) {
+    return ajson_to_strd(pool, ajsono_scan_k(j, key), default_value);
+}
+
+
+static inline int ajsono_get_int_k(ajson_t *j, const ajson_key_t *key, int default_value) {
+    return ajson_to_int(ajsono_get_k(j, key), default_value);
+}
+
+static inline int32_t ajsono_get_int32_k(ajson_t *j, const ajson_key_t *key, int32_t default_value) {
+    return ajson_to_int32(ajsono_get_k(j, key), default_value);
+}
+
+static inline uint32_t ajsono_get_uint32_k(ajson_t *j, const ajson_key_t *key, uint32_t default_value) {
+    return ajson_to_uint32(ajsono_get_k(j, key), default_value);
+}
+
+static inline int64_t ajsono_get_int64_k(ajson_t *j, const ajson_key_t *key, int64_t default_value) {
+    return ajson_to_int64(ajsono_get_k(j, key), default_value);
+}
+
+static inline uint64_t ajsono_get_uint64_k(ajson_t *j, const ajson_key_t *key, uint64_t default_value) {
+    return ajson_to_uint64(ajsono_get_k(j, key), default_value);
+}
+
+static inline float ajsono_get_float_k(ajson_t *j, const ajson_key_t *key, float default_value) {
+    return ajson_to_float(ajsono_get_k(j, key), default_value);
+}
+
+static inline double ajsono_get_double_k(ajson_t *j, const ajson_key_t *key, double default_value) {
+    return ajson_to_double(ajsono_get_k(j, key), default_value);
+}
+
+static inline bool ajsono_get_bool_k(ajson_t *j, const ajson_key_t *key, bool default_value) {
+    return ajson_to_bool(ajsono_get_k(j, key), default_value);
+}
+
+static inline char *ajsono_get_str_k(ajson_t *j, const ajson_key_t *key, const char *default_value) {
+    return ajson_to_str(ajsono_get_k(j, key), default_value);
+}
+
+static inline char *ajsono_get_strd_k(aml_pool_t *pool, ajson_t *j, const ajson_key_t *key, const char *default_value) {
+    return ajson_to_strd(pool, ajsono_get_k(j, key), default_value);
+}
+
+
+static inline int ajsono_find_int_k(ajson_t *j, const ajson_key_t *key, int default_value) {
+    return ajson_to_int(ajsono_find_k(j, key), default_value);
+}
+
+static inline int32_t ajsono_find_int32_k(ajson_t *j, const ajson_key_t *key, int32_t default_value) {
+    return ajson_to_int32(ajsono_find_k(j, key), default_value);
+}
+
+static inline uint32_t ajsono_find_uint32_k(ajson_t *j, const ajson_key_t *key, uint32_t default_value) {
+    return ajson_to_uint32(ajsono_find_k(j, key), default_value);
+}
+
+static inline int64_t ajsono_find_int64_k(ajson_t *j, const ajson_key_t *key, int64_t default_value) {
+    return ajson_to_int64(ajsono_find_k(j, key), default_value);
+}
+
+static inline uint64_t ajsono_find_uint64_k(ajson_t *j, const ajson_key_t *key, uint64_t default_value) {
+    return ajson_to_uint64(ajsono_find_k(j, key), default_value);
+}
+
+static inline float ajsono_find_float_k(ajson_t *j, const ajson_key_t *key, float default_value) {
+    return ajson_to_float(ajsono_find_k(j, key), default_value);
+}
+
+static inline double ajsono_find_double_k(ajson_t *j, const ajson_key_t *key, double default_value) {
+    return ajson_to_double(ajsono_find_k(j, key), default_value);
+}
+
+static inline bool ajsono_find_bool_k(ajson_t *j, const ajson_key_t *key, bool default_value) {
+    return ajson_to_bool(ajsono_find_k(j, key), default_value);
+}
+
+static inline char *ajsono_find_str_k(ajson_t *j, const ajson_key_t *key, const char *default_value) {
+    return ajson_to_str(ajsono_find_k(j, key), default_value);
+}
+
+static inline char *ajsono_find_strd_k(aml_pool_t *pool, ajson_t *j, const ajson_key_t *key, const char *default_value) {
+    return ajson_to_strd(pool, ajsono_find_k(j, key), default_value);
+}
+
+
+static inline int ajsono_hget_int_k(ajson_t *j, const ajson_key_t *key, int default_value) {
+    return ajson_to_int(ajsono_hget_k(j, key), default_value);
+}
+
+static inline int32_t ajsono_hget_int32_k(ajson_t *j, const ajson_key_t *key, int32_t default_value) {
+    return ajson_to_int32(ajsono_hget_k(j, key), default_value);
+}
+
+static inline uint32_t ajsono_hget_uint32_k(ajson_t *j, const ajson_key_t *key, uint32_t default_value) {
+    return ajson_to_uint32(ajsono_hget_k(j, key), default_value);
+}
+
+static inline int64_t ajsono_hget_int64_k(ajson_t *j, const ajson_key_t *key, int64_t default_value) {
+    return ajson_to_int64(ajsono_hget_k(j, key), default_value);
+}
+
+static inline uint64_t ajsono_hget_uint64_k(ajson_t *j, const ajson_key_t *key, uint64_t default_value) {
+    return ajson_to_uint64(ajsono_hget_k(j, key), default_value);
+}
+
+static inline float ajsono_hget_float_k(ajson_t *j, const ajson_key_t *key, float default_value) {
+    return ajson_to_float(ajsono_hget_k(j, key), default_value);
+}
+
+static inline double ajsono_hget_double_k(ajson_t *j, const ajson_key_t *key, double default_value) {
+    return ajson_to_double(ajsono_hget_k(j, key), default_value);
+}
+
+static inline bool ajsono_hget_bool_k(ajson_t *j, const ajson_key_t *key, bool default_value) {
+    return ajson_to_bool(ajsono_hget_k(j, key), default_value);
+}
+
+static inline char *ajsono_hget_str_k(ajson_t *j, const ajson_key_t *key, const char *default_value) {
+    return ajson_to_str(ajsono_hget_k(j, key), default_value);
+}
+
+static inline char *ajsono_hget_strd_k(aml_pool_t *pool, ajson_t *j, const ajson_key_t *key, const char *default_value) {
+    return ajson_to_strd(pool, ajsono_hget_k(j, key), default_value);
+}
+
+
+static inline int ajsono_hfind_int_k(ajson_t *j, const ajson_key_t *key, int default_value) {
+    return ajson_to_int(ajsono_hfind_k(j, key), default_value);
+}
+
+static inline int32_t ajsono_hfind_int32_k(ajson_t *j, const ajson_key_t *key, int32_t default_value) {
+    return ajson_to_int32(ajsono_hfind_k(j, key), default_value);
+}
+
+static inline uint32_t ajsono_hfind_uint32_k(ajson_t *j, const ajson_key_t *key, uint32_t default_value) {
+    return ajson_to_uint32(ajsono_hfind_k(j, key), default_value);
+}
+
+static inline int64_t ajsono_hfind_int64_k(ajson_t *j, const ajson_key_t *key, int64_t default_value) {
+    return ajson_to_int64(ajsono_hfind_k(j, key), default_value);
+}
+
+static inline uint64_t ajsono_hfind_uint64_k(ajson_t *j, const ajson_key_t *key, uint64_t default_value) {
+    return ajson_to_uint64(ajsono_hfind_k(j, key), default_value);
+}
+
+static inline float ajsono_hfind_float_k(ajson_t *j, const ajson_key_t *key, float default_value) {
+    return ajson_to_float(ajsono_hfind_k(j, key), default_value);
+}
+
+static inline double ajsono_hfind_double_k(ajson_t *j, const ajson_key_t *key, double default_value) {
+    return ajson_to_double(ajsono_hfind_k(j, key), default_value);
+}
+
+static inline bool ajsono_hfind_bool_k(ajson_t *j, const ajson_key_t *key, bool default_value) {
+    return ajson_to_bool(ajsono_hfind_k(j, key), default_value);
+}
+
+static inline char *ajsono_hfind_str_k(ajson_t *j, const ajson_key_t *key, const char *default_value) {
+    return ajson_to_str(ajsono_hfind_k(j, key), default_value);
+}
+
+static inline char *ajsono_hfind_strd_k(aml_pool_t *pool, ajson_t *j, const ajson_key_t *key, const char *default_value) {
+    return ajson_to_strd(pool, ajsono_hfind_k(j, key), default_value);
+}
+
+
 static inline ajson_t *ajsono_path(aml_pool_t *pool, ajson_t *j, const char *path) {
   size_t num_paths = 0;
   char **paths = aml_pool_split_with_escape2(pool, &num_paths, '.', '\\', path);
@@ -813,3 +1466,230 @@ static inline char *ajsono_pathd(aml_pool_t *pool, ajson_t *j, const char *path)
   j = ajsono_path(pool, j, path);
   return ajsond(pool, j);
 }
+
+#define AJSON_TAPE_TAG_SHIFT 56
+#define AJSON_TAPE_PAYLOAD_MASK ((1ULL << AJSON_TAPE_TAG_SHIFT) - 1)
+#define AJSON_TAPE_END_OBJECT 11
+#define AJSON_TAPE_END_ARRAY 12
+
+struct ajson_tape_s {
+  uint64_t *words;
+  size_t num_words;
+  char *strings;
+  size_t strings_length;
+};
+
+static inline uint32_t _ajson_tape_tag(const ajson_tape_t *t, size_t i) {
+  return (uint32_t)(t->words[i] >> AJSON_TAPE_TAG_SHIFT);
+}
+
+static inline size_t _ajson_tape_payload(const ajson_tape_t *t, size_t i) {
+  return (size_t)(t->words[i] & AJSON_TAPE_PAYLOAD_MASK);
+}
+
+static inline bool _ajson_tape_container(const ajson_tape_t *t, size_t i) {
+  uint32_t tag = _ajson_tape_tag(t, i);
+  return tag == AJSON_OBJECT || tag == AJSON_ARRAY;
+}
+
+static inline ajson_type_t ajson_tape_type(const ajson_tape_t *t, size_t i) {
+  if (i >= t->num_words)
+    return error;
+  return (ajson_type_t)_ajson_tape_tag(t, i);
+}
+
+static inline size_t ajson_tape_count(const ajson_tape_t *t, size_t i) {
+  if (i >= t->num_words || !_ajson_tape_container(t, i))
+    return 0;
+  return _ajson_tape_payload(t, _ajson_tape_payload(t, i));
+}
+
+static inline size_t ajson_tape_skip(const ajson_tape_t *t, size_t i) {
+  if (_ajson_tape_container(t, i))
+    return _ajson_tape_payload(t, i) + 1;
+  return i + 1;
+}
+
+static inline size_t ajson_tape_first(const ajson_tape_t *t, size_t i) {
+  if (i >= t->num_words || !_ajson_tape_container(t, i) ||
+      _ajson_tape_payload(t, i) == i + 1)
+    return AJSON_TAPE_NONE;
+  return i + 1;
+}
+
+static inline size_t ajson_tape_next(const ajson_tape_t *t, size_t i) {
+  if (i >= t->num_words)
+    return AJSON_TAPE_NONE;
+  i = ajson_tape_skip(t, i);
+  if (i >= t->num_words || _ajson_tape_tag(t, i) > AJSON_TRUE)
+    return AJSON_TAPE_NONE;
+  return i;
+}
+
+static inline const char *ajson_tape_value(const ajson_tape_t *t, size_t i,
+                                           size_t *length) {
+  uint32_t tag = i < t->num_words ? _ajson_tape_tag(t, i) : AJSON_ERROR;
+  if (tag == AJSON_NULL) {
+    *length = 4;
+    return "null";
+  } else if (tag == AJSON_TRUE) {
+    *length = 4;
+    return "true";
+  } else if (tag == AJSON_FALSE) {
+    *length = 5;
+    return "false";
+  } else if (tag == AJSON_ERROR || tag == AJSON_OBJECT || tag == AJSON_ARRAY ||
+             tag > AJSON_TRUE) {
+    *length = 0;
+    return NULL;
+  }
+  const char *s = t->strings + _ajson_tape_payload(t, i);
+  uint32_t len;
+  memcpy(&len, s, sizeof(len));
+  *length = len;
+  return s + sizeof(len);
+}
+
+static inline size_t ajson_tape_get(const ajson_tape_t *t, size_t i,
+                                    const char *key) {
+  if (ajson_tape_type(t, i) != AJSON_OBJECT)
+    return AJSON_TAPE_NONE;
+  size_t key_length = strlen(key);
+  size_t k = ajson_tape_first(t, i);
+  while (k != AJSON_TAPE_NONE) {
+    size_t length;
+    const char *s = ajson_tape_value(t, k, &length);
+    if (length == key_length && !memcmp(s, key, length))
+      return k + 1;
+    k = ajson_tape_next(t, k + 1);
+  }
+  return AJSON_TAPE_NONE;
+}
+
+static inline size_t ajson_tape_nth(const ajson_tape_t *t, size_t i,
+                                    size_t n) {
+  if (ajson_tape_type(t, i) != AJSON_ARRAY || n >= ajson_tape_count(t, i))
+    return AJSON_TAPE_NONE;
+  size_t end = _ajson_tape_payload(t, i);
+  size_t v = i + 1;
+  while (n && v < end) {
+    v = ajson_tape_skip(t, v);
+    n--;
+  }
+  return v < end ? v : AJSON_TAPE_NONE;
+}
+
+struct ajson_writer_s {
+  aml_buffer_t *bh;
+  bool comma;
+};
+
+static inline void ajson_writer_init(ajson_writer_t *w, aml_buffer_t *bh) {
+  w->bh = bh;
+  w->comma = false;
+}
+
+/* a value follows a comma unless it is the first in its container (or
+   follows a key) */
+static inline void _ajson_writer_value(ajson_writer_t *w) {
+  if (w->comma)
+    aml_buffer_appendc(w->bh, ',');
+  w->comma = true;
+}
+
+static inline void ajson_writer_begin_object(ajson_writer_t *w) {
+  _ajson_writer_value(w);
+  aml_buffer_appendc(w->bh, '{');
+  w->comma = false;
+}
+
+static inline void ajson_writer_end_object(ajson_writer_t *w) {
+  aml_buffer_appendc(w->bh, '}');
+  w->comma = true;
+}
+
+static inline void ajson_writer_begin_array(ajson_writer_t *w) {
+  _ajson_writer_value(w);
+  aml_buffer_appendc(w->bh, '[');
+  w->comma = false;
+}
+
+static inline void ajson_writer_end_array(ajson_writer_t *w) {
+  aml_buffer_appendc(w->bh, ']');
+  w->comma = true;
+}
+
+static inline void ajson_writer_key_string(ajson_writer_t *w,
+                                           const char *key, size_t length) {
+  char *wp = (char *)aml_buffer_append_alloc(w->bh,
+                                             length + (w->comma ? 4 : 3));
+  if (w->comma)
+    *wp++ = ',';
+  *wp++ = '\"';
+  memcpy(wp, key, length);
+  wp += length;
+  *wp++ = '\"';
+  *wp = ':';
+  w->comma = false;
+}
+
+static inline void ajson_writer_key(ajson_writer_t *w, const char *key) {
+  ajson_writer_key_string(w, key, strlen(key));
+}
+
+static inline void ajson_writer_null(ajson_writer_t *w) {
+  _ajson_writer_value(w);
+  aml_buffer_append(w->bh, "null", 4);
+}
+
+static inline void ajson_writer_string(ajson_writer_t *w, const char *s,
+                                       size_t length) {
+  if (!s) {
+    ajson_writer_null(w);
+    return;
+  }
+  _ajson_writer_value(w);
+  aml_buffer_appendc(w->bh, '\"');
+  _ajson_encode_to_buffer(w->bh, s, length);
+  aml_buffer_appendc(w->bh, '\"');
+}
+
+static inline void ajson_writer_str(ajson_writer_t *w, const char *s) {
+  ajson_writer_string(w, s, s ? strlen(s) : 0);
+}
+
+static inline void ajson_writer_int64(ajson_writer_t *w, int64_t n) {
+  char buf[24];
+  _ajson_writer_value(w);
+  aml_buffer_append(w->bh, buf, _ajson_int64_text(buf, n));
+}
+
+static inline void ajson_writer_uint64(ajson_writer_t *w, uint64_t n) {
+  char buf[24];
+  _ajson_writer_value(w);
+  aml_buffer_append(w->bh, buf, _ajson_uint64_text(buf, n));
+}
+
+static inline void ajson_writer_double(ajson_writer_t *w, double n) {
+  char buf[32];
+  size_t length = _ajson_double_text(buf, n);
+  if (!length) {
+    ajson_writer_null(w);
+    return;
+  }
+  _ajson_writer_value(w);
+  aml_buffer_append(w->bh, buf, length);
+}
+
+static inline void ajson_writer_bool(ajson_writer_t *w, bool v) {
+  _ajson_writer_value(w);
+  if (v)
+    aml_buffer_append(w->bh, "true", 4);
+  else
+    aml_buffer_append(w->bh, "false", 5);
+}
+
+static inline void ajson_writer_json(ajson_writer_t *w, ajson_t *j) {
+  _ajson_writer_value(w);
+  ajson_dump_to_buffer(w->bh, j);
+}
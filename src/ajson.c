@@ -15,6 +15,8 @@ limitations under the License.
 */
 
 #include "a-json-library/ajson.h"
+#include "ajson_index.h"
+#include "ajson_utf8.h"
 
 #include "a-memory-library/aml_pool.h"
 
@@ -22,6 +24,7 @@ limitations under the License.
 
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define AJSON_NATURAL_NUMBER_CASE                                            \
@@ -100,30 +103,22 @@ limitations under the License.
 #define AJSON_DECIMAL_NUMBER goto decimal_number
 #endif
 
-static void ajson_dump_object_to_buffer(aml_buffer_t *bh, _ajsono_t *a);
-static void ajson_dump_array_to_buffer(aml_buffer_t *bh, _ajsona_t *a);
+/* ajson_dump writes through a buffer, which is flushed whenever it grows
+   past AJSON_DUMP_BLOCK, so the file is written in large blocks instead of
+   a stdio call per token.  out is NULL for ajson_dump_to_buffer. */
+#define AJSON_DUMP_BLOCK (64 * 1024)
 
-void ajson_dump_to_buffer(aml_buffer_t *bh, ajson_t *a) {
-  if (a->type >= AJSON_STRING) {
-    if (a->type == AJSON_STRING) {
-      aml_buffer_appendc(bh, '\"');
-      aml_buffer_append(bh, a->value, a->length);
-      aml_buffer_appendc(bh, '\"');
-    } else
-      aml_buffer_append(bh, a->value, a->length);
-  } else if (a->type == AJSON_OBJECT) {
-    ajson_dump_object_to_buffer(bh, (_ajsono_t *)a);
-  } else if (a->type == AJSON_ARRAY) {
-    ajson_dump_array_to_buffer(bh, (_ajsona_t *)a);
-  } else if (a->type == AJSON_BINARY) {
-    aml_buffer_append(bh, "nb", 2);
-    uint32_t len = a->length;
-    aml_buffer_append(bh, &len, sizeof(len));
-    aml_buffer_append(bh, a->value, a->length);
+static inline void ajson_dump_flush(aml_buffer_t *bh, FILE *out) {
+  if (out && aml_buffer_length(bh) >= AJSON_DUMP_BLOCK) {
+    fwrite(aml_buffer_data(bh), aml_buffer_length(bh), 1, out);
+    aml_buffer_clear(bh);
   }
 }
 
-static void ajson_dump_object_to_buffer(aml_buffer_t *bh, _ajsono_t *a) {
+static void ajson_dump_value(aml_buffer_t *bh, FILE *out, ajson_t *a);
+
+static void ajson_dump_object_to_buffer(aml_buffer_t *bh, FILE *out,
+                                        _ajsono_t *a) {
   aml_buffer_appendc(bh, '{');
   ajsono_t *n = a->head;
   while (n) {
@@ -131,390 +126,280 @@ static void ajson_dump_object_to_buffer(aml_buffer_t *bh, _ajsono_t *a) {
     while (next && next->value == NULL)
       next = next->next;
     aml_buffer_appendc(bh, '\"');
-    aml_buffer_appends(bh, n->key);
+    aml_buffer_append(bh, n->key, n->key_length);
     aml_buffer_append(bh, "\":", 2);
-    ajson_dump_to_buffer(bh, n->value);
+    ajson_dump_value(bh, out, n->value);
     if (next)
       aml_buffer_appendc(bh, ',');
+    ajson_dump_flush(bh, out);
     n = next;
   }
 
   aml_buffer_appendc(bh, '}');
 }
 
-static void ajson_dump_array_to_buffer(aml_buffer_t *bh, _ajsona_t *a) {
+static void ajson_dump_array_to_buffer(aml_buffer_t *bh, FILE *out,
+                                       _ajsona_t *a) {
   aml_buffer_appendc(bh, '[');
   ajsona_t *n = a->head;
   while (n) {
     ajsona_t *next = n->next;
     while (next && next->value == NULL)
       next = next->next;
-    ajson_dump_to_buffer(bh, n->value);
+    ajson_dump_value(bh, out, n->value);
     if (next)
       aml_buffer_appendc(bh, ',');
+    ajson_dump_flush(bh, out);
     n = next;
   }
   aml_buffer_appendc(bh, ']');
 }
 
-static void ajson_dump_object(FILE *out, _ajsono_t *a);
-static void ajson_dump_array(FILE *out, _ajsona_t *a);
-
-void ajson_dump(FILE *out, ajson_t *a) {
-  if (a->type >= AJSON_STRING) {
-    if (a->type == AJSON_STRING)
-      fprintf(out, "\"%s\"", a->value);
-    else
-      fprintf(out, "%s", a->value);
+static void ajson_dump_value(aml_buffer_t *bh, FILE *out, ajson_t *a) {
+  if (a->type >= AJSON_NULL) {
+    if (a->type == AJSON_STRING) {
+      aml_buffer_appendc(bh, '\"');
+      aml_buffer_append(bh, a->value, a->length);
+      aml_buffer_appendc(bh, '\"');
+    } else
+      aml_buffer_append(bh, a->value, a->length);
   } else if (a->type == AJSON_OBJECT) {
-    ajson_dump_object(out, (_ajsono_t *)a);
+    ajson_dump_object_to_buffer(bh, out, (_ajsono_t *)a);
   } else if (a->type == AJSON_ARRAY) {
-    ajson_dump_array(out, (_ajsona_t *)a);
+    ajson_dump_array_to_buffer(bh, out, (_ajsona_t *)a);
   } else if (a->type == AJSON_BINARY) {
-    fprintf(out, "b");
+    aml_buffer_append(bh, "nb", 2);
     uint32_t len = a->length;
-    fwrite(&len, sizeof(len), 1, out);
-    fwrite(a->value, a->length, 1, out);
+    aml_buffer_append(bh, &len, sizeof(len));
+    aml_buffer_append(bh, a->value, a->length);
   }
 }
 
-static void ajson_dump_object(FILE *out, _ajsono_t *a) {
-  fprintf(out, "{");
-  ajsono_t *n = a->head;
-  while (n) {
-    ajsono_t *next = n->next;
-    while (next && next->value == NULL)
-      next = next->next;
-
-    fprintf(out, "\"%s\":", n->key);
-    ajson_dump(out, n->value);
-    if (next)
-      fprintf(out, ",");
-    n = next;
-  }
-
-  fprintf(out, "}");
+void ajson_dump_to_buffer(aml_buffer_t *bh, ajson_t *a) {
+  ajson_dump_value(bh, NULL, a);
 }
 
-static void ajson_dump_array(FILE *out, _ajsona_t *a) {
-  fprintf(out, "[");
-  ajsona_t *n = a->head;
-  while (n) {
-    ajsona_t *next = n->next;
-    while (next && next->value == NULL)
-      next = next->next;
+/* The size of the output of ajson_dump_to_buffer, which follows the same
+   rules (members and elements whose value was erased are skipped). */
+size_t ajson_serialized_size(ajson_t *a) {
+  if (a->type >= AJSON_NULL)
+    return a->type == AJSON_STRING ? a->length + 2 : a->length;
+  if (a->type == AJSON_BINARY)
+    return 2 + sizeof(uint32_t) + a->length;
+  size_t size = 2, count = 0;
+  if (a->type == AJSON_OBJECT) {
+    for (ajsono_t *n = ((_ajsono_t *)a)->head; n; n = n->next) {
+      if (!n->value)
+        continue;
+      size += n->key_length + 3 + ajson_serialized_size(n->value);
+      count++;
+    }
+  } else if (a->type == AJSON_ARRAY) {
+    for (ajsona_t *n = ((_ajsona_t *)a)->head; n; n = n->next) {
+      if (!n->value)
+        continue;
+      size += ajson_serialized_size(n->value);
+      count++;
+    }
+  } else
+    return 0;
+  return count ? size + count - 1 : size;
+}
 
-    ajson_dump(out, n->value);
-    if (next)
-      fprintf(out, ",");
-    n = next;
+/* writes the output of ajson_dump_to_buffer to wp, which has room for it,
+   and returns the end */
+static char *ajson_dump_exact(char *wp, ajson_t *a) {
+  if (a->type >= AJSON_NULL) {
+    if (a->type == AJSON_STRING) {
+      *wp++ = '\"';
+      memcpy(wp, a->value, a->length);
+      wp += a->length;
+      *wp++ = '\"';
+    } else {
+      memcpy(wp, a->value, a->length);
+      wp += a->length;
+    }
+  } else if (a->type == AJSON_OBJECT) {
+    *wp++ = '{';
+    bool comma = false;
+    for (ajsono_t *n = ((_ajsono_t *)a)->head; n; n = n->next) {
+      if (!n->value)
+        continue;
+      if (comma)
+        *wp++ = ',';
+      comma = true;
+      *wp++ = '\"';
+      memcpy(wp, n->key, n->key_length);
+      wp += n->key_length;
+      *wp++ = '\"';
+      *wp++ = ':';
+      wp = ajson_dump_exact(wp, n->value);
+    }
+    *wp++ = '}';
+  } else if (a->type == AJSON_ARRAY) {
+    *wp++ = '[';
+    bool comma = false;
+    for (ajsona_t *n = ((_ajsona_t *)a)->head; n; n = n->next) {
+      if (!n->value)
+        continue;
+      if (comma)
+        *wp++ = ',';
+      comma = true;
+      wp = ajson_dump_exact(wp, n->value);
+    }
+    *wp++ = ']';
+  } else if (a->type == AJSON_BINARY) {
+    uint32_t len = a->length;
+    memcpy(wp, "nb", 2);
+    memcpy(wp + 2, &len, sizeof(len));
+    memcpy(wp + 2 + sizeof(len), a->value, a->length);
+    wp += 2 + sizeof(len) + a->length;
   }
-  fprintf(out, "]");
+  return wp;
 }
 
-static int unicode_to_utf8(char *dest, char **src) {
-  char *s = *src;
-  unsigned int ch;
-  int c = *s++;
-  if (c >= '0' && c <= '9')
-    ch = c - '0';
-  else if (c >= 'A' && c <= 'F')
-    ch = c - 'A' + 10;
-  else if (c >= 'a' && c <= 'f')
-    ch = c - 'a' + 10;
-  else
-    return -1;
-
-  c = *s++;
-  if (c >= '0' && c <= '9')
-    ch = (ch << 4) + c - '0';
-  else if (c >= 'A' && c <= 'F')
-    ch = (ch << 4) + c - 'A' + 10;
-  else if (c >= 'a' && c <= 'f')
-    ch = (ch << 4) + c - 'a' + 10;
-  else
-    return -1;
-
-  c = *s++;
-  if (c >= '0' && c <= '9')
-    ch = (ch << 4) + c - '0';
-  else if (c >= 'A' && c <= 'F')
-    ch = (ch << 4) + c - 'A' + 10;
-  else if (c >= 'a' && c <= 'f')
-    ch = (ch << 4) + c - 'a' + 10;
-  else
-    return -1;
-
-  c = *s++;
-  if (c >= '0' && c <= '9')
-    ch = (ch << 4) + c - '0';
-  else if (c >= 'A' && c <= 'F')
-    ch = (ch << 4) + c - 'A' + 10;
-  else if (c >= 'a' && c <= 'f')
-    ch = (ch << 4) + c - 'a' + 10;
-  else
-    return -1;
-
-  if (ch >= 0xD800 && ch <= 0xDBFF) {
-    if (*s != '\\' || s[1] != 'u')
-      return -1;
-    s += 2;
-    unsigned int ch2;
-    c = *s++;
-    if (c >= '0' && c <= '9')
-      ch2 = c - '0';
-    else if (c >= 'A' && c <= 'F')
-      ch2 = c - 'A' + 10;
-    else if (c >= 'a' && c <= 'f')
-      ch2 = c - 'a' + 10;
-    else
-      return -1;
-
-    c = *s++;
-    if (c >= '0' && c <= '9')
-      ch2 = (ch2 << 4) + c - '0';
-    else if (c >= 'A' && c <= 'F')
-      ch2 = (ch2 << 4) + c - 'A' + 10;
-    else if (c >= 'a' && c <= 'f')
-      ch2 = (ch2 << 4) + c - 'a' + 10;
-    else
-      return -1;
-
-    c = *s++;
-    if (c >= '0' && c <= '9')
-      ch2 = (ch2 << 4) + c - '0';
-    else if (c >= 'A' && c <= 'F')
-      ch2 = (ch2 << 4) + c - 'A' + 10;
-    else if (c >= 'a' && c <= 'f')
-      ch2 = (ch2 << 4) + c - 'a' + 10;
-    else
-      return -1;
-
-    c = *s++;
-    if (c >= '0' && c <= '9')
-      ch2 = (ch2 << 4) + c - '0';
-    else if (c >= 'A' && c <= 'F')
-      ch2 = (ch2 << 4) + c - 'A' + 10;
-    else if (c >= 'a' && c <= 'f')
-      ch2 = (ch2 << 4) + c - 'a' + 10;
-    else
-      return -1;
-    if (ch2 < 0xDC00 || ch2 > 0xDFFF)
-      return -1;
-    ch = ((ch - 0xD800) << 10) + (ch2 - 0xDC00) + 0x10000;
-  }
+void ajson_dump_to_buffer_exact(aml_buffer_t *bh, ajson_t *a) {
+  size_t size = ajson_serialized_size(a);
+  char *wp = (char *)aml_buffer_append_alloc(bh, size);
+  ajson_dump_exact(wp, a);
+}
 
-  *src = s;
+/* Pretty printing writes containers itself and everything else through
+   ajson_dump_value.  When keys are sorted, the members of each object are
+   gathered on a stack shared by all levels (it may move as it grows, so the
+   members are always found by their offset). */
+typedef struct {
+  aml_buffer_t *bh;
+  aml_buffer_t *members;
+  size_t indent;
+} ajson_pretty_t;
+
+static inline bool ajson_pretty_key_less(ajsono_t *const *a,
+                                         ajsono_t *const *b) {
+  uint32_t alen = (*a)->key_length, blen = (*b)->key_length;
+  int r = memcmp((*a)->key, (*b)->key, alen < blen ? alen : blen);
+  return r < 0 || (r == 0 && alen < blen);
+}
 
-  if (ch < 0x80) {
-    dest[0] = (char)ch;
-    return 1;
-  }
-  if (ch < 0x800) {
-    dest[0] = (ch >> 6) | 0xC0;
-    dest[1] = (ch & 0x3F) | 0x80;
-    return 2;
-  }
-  if (ch < 0x10000) {
-    dest[0] = (ch >> 12) | 0xE0;
-    dest[1] = ((ch >> 6) & 0x3F) | 0x80;
-    dest[2] = (ch & 0x3F) | 0x80;
-    return 3;
-  }
-  if (ch < 0x110000) {
-    dest[0] = (ch >> 18) | 0xF0;
-    dest[1] = ((ch >> 12) & 0x3F) | 0x80;
-    dest[2] = ((ch >> 6) & 0x3F) | 0x80;
-    dest[3] = (ch & 0x3F) | 0x80;
-    return 4;
-  }
-  return 0;
+macro_sort(__ajson_pretty_sort, ajsono_t *, ajson_pretty_key_less);
+
+static inline void ajson_pretty_line(ajson_pretty_t *pp, size_t depth) {
+  size_t spaces = pp->indent * depth;
+  char *wp = (char *)aml_buffer_append_alloc(pp->bh, spaces + 1);
+  *wp++ = '\n';
+  memset(wp, ' ', spaces);
 }
 
-static inline char *_ajson_decode(aml_pool_t *pool, char **eptr, char *s, char *p,
-                                    size_t length) {
-  char *sp;
-  char *res = (char *)aml_pool_alloc(pool, length + 1);
-  size_t pos = p - s;
-  memcpy(res, s, pos);
-  char *rp = res + pos;
-  char *ep = s + length;
-  while (p < ep) {
-    int ch = *p++;
-    if (ch != '\\')
-      *rp++ = ch;
-    else {
-      ch = *p++;
-      switch (ch) {
-      case '\"':
-        *rp++ = '\"';
-        break;
-      case '\\':
-        *rp++ = '\\';
-        break;
-      case '/':
-        *rp++ = '/';
-        break;
-      case 'b':
-        *rp++ = 8;
-        break;
-      case 'f':
-        *rp++ = 12;
-        break;
-      case 'n':
-        *rp++ = 10;
-        break;
-      case 'r':
-        *rp++ = 13;
-        break;
-      case 't':
-        *rp++ = 9;
-        break;
-      case 'u':
-        sp = p - 2;
-        ch = unicode_to_utf8(rp, &p);
-        if (ch == -1) {
-          p = sp;
-          *rp++ = *p++;
-          *rp++ = *p++;
-          *rp++ = *p++;
-          *rp++ = *p++;
-          *rp++ = *p++;
-          *rp++ = *p++;
-        } else
-          rp += ch;
-        break;
-      }
-    }
-  }
-  *rp = 0;
-  *eptr = rp;
-  return res;
+static inline void ajson_pretty_key(ajson_pretty_t *pp, ajsono_t *n) {
+  char *wp = (char *)aml_buffer_append_alloc(pp->bh, n->key_length + 4);
+  *wp++ = '\"';
+  memcpy(wp, n->key, n->key_length);
+  wp += n->key_length;
+  memcpy(wp, "\": ", 3);
 }
 
-char *_ajson_encode(aml_pool_t *pool, char *s, char *p, size_t length) {
-  char *res = (char *)aml_pool_alloc(pool, (length * 2) + 3);
-  char *wp = res;
-  memcpy(res, s, p - s);
-  wp += (p - s);
-  char *ep = s + length;
-  while (p < ep) {
-    switch (*p) {
-    case '\"':
-      *wp++ = '\\';
-      *wp++ = '\"';
-      p++;
-      break;
-    case '\\':
-      *wp++ = '\\';
-      *wp++ = '\\';
-      p++;
-      break;
-    case '/':
-      *wp++ = '\\';
-      *wp++ = '/';
-      p++;
-      break;
-    case '\b':
-      *wp++ = '\\';
-      *wp++ = 'b';
-      p++;
-      break;
-    case '\f':
-      *wp++ = '\\';
-      *wp++ = 'f';
-      p++;
-      break;
-    case '\n':
-      *wp++ = '\\';
-      *wp++ = 'n';
-      p++;
-      break;
-    case '\r':
-      *wp++ = '\\';
-      *wp++ = 'r';
-      p++;
-      break;
-    case '\t':
-      *wp++ = '\\';
-      *wp++ = 't';
-      p++;
-      break;
-    default:
-      *wp++ = *p++;
-      break;
+static void ajson_pretty_value(ajson_pretty_t *pp, ajson_t *a, size_t depth);
+
+static void ajson_pretty_object(ajson_pretty_t *pp, _ajsono_t *o,
+                                size_t depth) {
+  aml_buffer_appendc(pp->bh, '{');
+  bool comma = false;
+  if (pp->members) {
+    size_t offset = aml_buffer_length(pp->members);
+    size_t num_members = 0;
+    for (ajsono_t *n = o->head; n; n = n->next) {
+      if (!n->value)
+        continue;
+      aml_buffer_append(pp->members, &n, sizeof(n));
+      num_members++;
+    }
+    __ajson_pretty_sort(
+        (ajsono_t **)(aml_buffer_data(pp->members) + offset), num_members);
+    for (size_t i = 0; i < num_members; i++) {
+      ajsono_t *n =
+          ((ajsono_t **)(aml_buffer_data(pp->members) + offset))[i];
+      if (comma)
+        aml_buffer_appendc(pp->bh, ',');
+      comma = true;
+      ajson_pretty_line(pp, depth + 1);
+      ajson_pretty_key(pp, n);
+      ajson_pretty_value(pp, n->value, depth + 1);
+    }
+    aml_buffer_resize(pp->members, offset);
+  } else {
+    for (ajsono_t *n = o->head; n; n = n->next) {
+      if (!n->value)
+        continue;
+      if (comma)
+        aml_buffer_appendc(pp->bh, ',');
+      comma = true;
+      ajson_pretty_line(pp, depth + 1);
+      ajson_pretty_key(pp, n);
+      ajson_pretty_value(pp, n->value, depth + 1);
     }
   }
-  *wp = 0;
-  return res;
+  if (comma)
+    ajson_pretty_line(pp, depth);
+  aml_buffer_appendc(pp->bh, '}');
 }
 
-char *ajson_encode(aml_pool_t *pool, char *s, size_t length) {
-  char *p = s;
-  char *ep = p + length;
-  if(*ep != 0) {
-    s = aml_pool_dup(pool, s, length+1);
-    s[length] = 0;
-    p = s;
-    ep = p + length;
-  }
-  while (p < ep) {
-    switch (*p) {
-    case '\0':
-    case '\"':
-    case '\\':
-    case '/':
-    case '\b':
-    case '\f':
-    case '\n':
-    case '\r':
-    case '\t':
-      return _ajson_encode(pool, s, p, length);
-    default:
-      p++;
-    }
+static void ajson_pretty_array(ajson_pretty_t *pp, _ajsona_t *arr,
+                               size_t depth) {
+  aml_buffer_appendc(pp->bh, '[');
+  bool comma = false;
+  for (ajsona_t *n = arr->head; n; n = n->next) {
+    if (!n->value)
+      continue;
+    if (comma)
+      aml_buffer_appendc(pp->bh, ',');
+    comma = true;
+    ajson_pretty_line(pp, depth + 1);
+    ajson_pretty_value(pp, n->value, depth + 1);
   }
-  return s;
+  if (comma)
+    ajson_pretty_line(pp, depth);
+  aml_buffer_appendc(pp->bh, ']');
 }
 
-char *ajson_decode(aml_pool_t *pool, char *s, size_t length) {
-  char *p = s;
-  char *ep = p + length;
-  for (;;) {
-    if (p == ep)
-      return s;
-    else if (*p == '\\')
-      break;
-    p++;
-  }
-  char *eptr = NULL;
-  return _ajson_decode(pool, &eptr, s, p, length);
+static void ajson_pretty_value(ajson_pretty_t *pp, ajson_t *a, size_t depth) {
+  if (a->type == AJSON_OBJECT)
+    ajson_pretty_object(pp, (_ajsono_t *)a, depth);
+  else if (a->type == AJSON_ARRAY)
+    ajson_pretty_array(pp, (_ajsona_t *)a, depth);
+  else
+    ajson_dump_value(pp->bh, NULL, a);
 }
 
-char *ajson_decode2(size_t *rlen, aml_pool_t *pool, char *s, size_t length) {
-  char *p = s;
-  char *ep = p + length;
-  for (;;) {
-    if (p == ep) {
-      *rlen = length;
-      return s;
-    }
-    else if (*p == '\\')
-      break;
-    p++;
-  }
-  char *eptr = NULL;
-  char *r = _ajson_decode(pool, &eptr, s, p, length);
-  *rlen = eptr - r;
-  return r;
+void ajson_dump_pretty_to_buffer(aml_buffer_t *bh, ajson_t *a, size_t indent,
+                                 bool sort_keys) {
+  ajson_pretty_t pp;
+  pp.bh = bh;
+  pp.members = sort_keys ? aml_buffer_init(sizeof(ajsono_t *) * 64) : NULL;
+  pp.indent = indent;
+  ajson_pretty_value(&pp, a, 0);
+  if (pp.members)
+    aml_buffer_destroy(pp.members);
 }
 
+void ajson_dump(FILE *out, ajson_t *a) {
+  aml_buffer_t *bh = aml_buffer_init(AJSON_DUMP_BLOCK + 4096);
+  ajson_dump_value(bh, out, a);
+  if (aml_buffer_length(bh))
+    fwrite(aml_buffer_data(bh), aml_buffer_length(bh), 1, out);
+  aml_buffer_destroy(bh);
+}
 
-void ajson_dump_error_to_buffer(aml_buffer_t *bh, ajson_t *j) {
-  ajson_error_t *err = (ajson_error_t *)j;
+static void ajson_error_position(ajson_error_t *err, size_t *row,
+                                 size_t *column, size_t *offset) {
+  if (!err->source) {
+    *row = err->row;
+    *column = err->column;
+    *offset = err->offset;
+    return;
+  }
   char *p = err->source;
   char *ep = err->error_at;
-  int row = 1;
+  size_t r = 1;
   char *srow = p;
   while (p < ep) {
     if (*p == '\\') {
@@ -522,60 +407,152 @@ void ajson_dump_error_to_buffer(aml_buffer_t *bh, ajson_t *j) {
       continue;
     } else if (*p == '\n') {
       p++;
-      row++;
+      r++;
       srow = p;
     } else
       p++;
   }
+  *row = r;
+  *column = (p - srow) + 1;
+  *offset = ep - err->source;
+}
+
+void ajson_dump_error_to_buffer(aml_buffer_t *bh, ajson_t *j) {
+  ajson_error_t *err = (ajson_error_t *)j;
+  size_t row, column, offset;
+  ajson_error_position(err, &row, &column, &offset);
 #ifdef AJSON_DEBUG
   aml_buffer_appendf(bh,
-                    "Error at row %d, column: %ld (%ld bytes into json) "
+                    "Error at row %zu, column: %zu (%zu bytes into json) "
                     "thrown from %d/%d\n",
-                    row, (p - srow) + 1, ep - err->source, err->line,
-                    err->line2);
+                    row, column, offset, err->line, err->line2);
 #else
-  aml_buffer_appendf(bh, "Error at row %d, column: %ld (%ld bytes into json)\n",
-                    row, (p - srow) + 1, ep - err->source);
+  aml_buffer_appendf(bh, "Error at row %zu, column: %zu (%zu bytes into json)\n",
+                    row, column, offset);
 #endif
 }
 
 void ajson_dump_error(FILE *out, ajson_t *j) {
   ajson_error_t *err = (ajson_error_t *)j;
-  char *p = err->source;
-  char *ep = err->error_at;
-  int row = 1;
-  char *srow = p;
-  while (p < ep) {
-    if (*p == '\\') {
-      p += 2;
-      continue;
-    } else if (*p == '\n') {
-      p++;
-      row++;
-      srow = p;
-    } else
-      p++;
-  }
+  size_t row, column, offset;
+  ajson_error_position(err, &row, &column, &offset);
 #ifdef AJSON_DEBUG
   fprintf(out,
-          "Error at row %d, column: %ld (%ld bytes into json) thrown from "
+          "Error at row %zu, column: %zu (%zu bytes into json) thrown from "
           "%d/%d\n",
-          row, (p - srow) + 1, ep - err->source, err->line, err->line2);
+          row, column, offset, err->line, err->line2);
 #else
-  fprintf(out, "Error at row %d, column: %ld (%ld bytes into json)\n", row,
-          (p - srow) + 1, ep - err->source);
+  fprintf(out, "Error at row %zu, column: %zu (%zu bytes into json)\n", row,
+          column, offset);
 #endif
 }
 
-ajson_t *ajson_parse(aml_pool_t *pool, char *p, char *ep) {
+/* When arrays are parsed into contiguous storage, the elements of every open
+   array are collected on a stack of slots and copied into one exactly sized
+   allocation when the array is closed.  Container elements are referenced,
+   all other values are copied. */
+typedef struct {
+  ajson_t *ref;
+  ajson_t value;
+} ajsona_slot_t;
+
+static inline void ajsona_push_ref(aml_buffer_t *slots, _ajsona_t *arr,
+                                   ajson_t *ref) {
+  ajsona_slot_t *slot =
+      (ajsona_slot_t *)aml_buffer_append_alloc(slots, sizeof(ajsona_slot_t));
+  slot->ref = ref;
+  arr->num_entries++;
+}
+
+static inline ajson_t *ajsona_push_value(aml_buffer_t *slots,
+                                         _ajsona_t *arr) {
+  ajsona_slot_t *slot =
+      (ajsona_slot_t *)aml_buffer_append_alloc(slots, sizeof(ajsona_slot_t));
+  slot->ref = NULL;
+  arr->num_entries++;
+  return &slot->value;
+}
+
+static void ajsona_close_slots(aml_buffer_t *slots, _ajsona_t *arr) {
+  size_t num_entries = arr->num_entries;
+  if (!num_entries)
+    return;
+  size_t length = aml_buffer_length(slots) - (num_entries * sizeof(ajsona_slot_t));
+  ajsona_slot_t *slot = (ajsona_slot_t *)(aml_buffer_data(slots) + length);
+  ajsona_t *nodes = (ajsona_t *)aml_pool_alloc(
+      arr->pool, num_entries * (sizeof(ajsona_t) + sizeof(ajson_t)));
+  ajson_t *values = (ajson_t *)(nodes + num_entries);
+  ajsona_t *previous = NULL;
+  for (size_t i = 0; i < num_entries; i++) {
+    ajsona_t *n = nodes + i;
+    if (slot[i].ref)
+      n->value = slot[i].ref;
+    else {
+      values[i] = slot[i].value;
+      n->value = values + i;
+    }
+    n->previous = previous;
+    n->next = n + 1;
+    previous = n;
+  }
+  previous->next = NULL;
+  arr->head = nodes;
+  arr->tail = previous;
+  arr->nodes = nodes;
+  aml_buffer_resize(slots, length);
+}
+
+/* In the non-destructive mode (slice is AJSON_SLICE), strings and numbers
+   are not terminated in place.  They are flagged as slices of the input and
+   copied by _ajson_terminate when they are first accessed. */
+#define AJSON_TERMINATE(p)                                                     \
+  do {                                                                         \
+    if (!slice)                                                                \
+      *(p) = 0;                                                                \
+  } while (0)
+
+/* With AJSON_PARSE_NUMBERS, integers which fit in an int64_t are stored
+   exactly and all other numbers as a double.  The conversion is made as the
+   number is added (its digits were just scanned, so they are in the
+   cache). */
+static void _ajson_number_convert(ajson_t *j, const char *s, size_t length) {
+  _ajson_number_t *n = (_ajson_number_t *)j;
+  if (j->type == AJSON_NUMBER && _ajson_to_int64(s, length, &n->number.i))
+    j->flags |= AJSON_INT64;
+  else if (_ajson_to_double(s, length, &n->number.d))
+    j->flags |= AJSON_DOUBLE;
+}
+
+/* With AJSON_PARSE_VALIDATE_UTF8, each key and string is validated as soon
+   as its closing quote is found (while it is still in the cache).  If it is
+   not valid, the error points at the invalid sequence. */
+#define AJSON_VALIDATE_UTF8(s)                                                 \
+  do {                                                                         \
+    if (utf8) {                                                                \
+      size_t utf8_length = p - (s);                                            \
+      size_t utf8_offset = _ajson_utf8_check((s), utf8_length);                \
+      if (utf8_offset < utf8_length) {                                         \
+        p = (s) + utf8_offset;                                                 \
+        AJSON_BAD_CHARACTER;                                                   \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+
+#define AJSON_CONVERT_NUMBER                                                   \
+  (numbers && (data_type == AJSON_NUMBER || data_type == AJSON_DECIMAL))
+
+static ajson_t *_ajson_parse(aml_pool_t *pool, char *p, char *ep,
+                             ajson_index_t *ix, aml_buffer_t *slots,
+                             uint16_t slice, bool numbers, bool utf8) {
 #ifdef AJSON_DEBUG
   int line, line2 = 0;
 #endif
   char *sp = p;
   char ch;
   char *key = NULL;
+  uint32_t key_length = 0, key_hash = 0;
   char *stringp = NULL;
-  ajsona_t *anode;
+  ajsona_t *anode = NULL;
   _ajsono_t *obj;
   _ajsona_t *arr = NULL, *arr2;
   ajson_t *j;
@@ -608,6 +585,8 @@ start_key:;
     key = p;
     goto get_end_of_key;
   case AJSON_SPACE_CASE:
+    if (ix)
+      p = _ajson_index_skip_space(ix, p);
     AJSON_START_KEY;
   case '}':
     // if (mode == AJSON_RDONLY)
@@ -634,6 +613,12 @@ start_key:;
   };
 
 get_end_of_key:;
+  if (ix) {
+    p = _ajson_index_quote(ix, p);
+    if (p < ep)
+      AJSON_TERMINATE(p);
+    goto end_of_key;
+  }
   while (p < ep && *p != '\"')
     p++;
   if (p < ep) {
@@ -647,8 +632,19 @@ get_end_of_key:;
             goto get_end_of_key;
         }
     }
-    *p = 0;
+    AJSON_TERMINATE(p);
+  }
+end_of_key:;
+  AJSON_VALIDATE_UTF8(key);
+  key_length = p - key;
+  if (slice) {
+    /* keys are exposed directly (ajsono_t->key), so they are copied */
+    char *k = (char *)aml_pool_alloc(pool, key_length + 1);
+    memcpy(k, key, key_length);
+    k[key_length] = 0;
+    key = k;
   }
+  key_hash = ajson_hash(key, key_length);
   p++;
   while (p < ep && *p != ':')
     p++;
@@ -665,13 +661,16 @@ start_key_object:;
     data_type = AJSON_STRING;
     AJSON_KEYED_START_STRING;
   case AJSON_SPACE_CASE:
+    if (ix)
+      p = _ajson_index_skip_space(ix, p);
     goto start_key_object;
   case '{':
     obj = (_ajsono_t *)aml_pool_zalloc(pool, sizeof(_ajsono_t));
     obj->type = AJSON_OBJECT;
     obj->pool = pool;
     // obj->parent = (ajson_t *)root;
-    ajsono_append((ajson_t *)root, key, (ajson_t *)obj, false);
+    _ajsono_append((ajson_t *)root, key, key_length, key_hash,
+                   (ajson_t *)obj, false);
 
     root = obj;
     AJSON_START_KEY;
@@ -680,7 +679,8 @@ start_key_object:;
     arr->type = AJSON_ARRAY;
     arr->pool = pool;
     // arr->parent = (ajson_t *)root;
-    ajsono_append((ajson_t *)root, key, (ajson_t *)arr, false);
+    _ajsono_append((ajson_t *)root, key, key_length, key_hash,
+                   (ajson_t *)arr, false);
     root = (_ajsono_t *)arr;
     AJSON_START_VALUE;
   case '-':
@@ -791,6 +791,8 @@ start_key_object:;
         data_type = AJSON_BINARY;
         stringp = p;
         p += string_length;
+        if (ix)
+          _ajson_index_reset(ix, p);
         ch = *p;
         AJSON_KEYED_ADD_STRING;
       }
@@ -814,6 +816,13 @@ start_key_object:;
   };
 
 keyed_start_string:;
+  if (ix) {
+    p = _ajson_index_quote(ix, p);
+    if (p >= ep) {
+      AJSON_BAD_CHARACTER;
+    }
+    goto keyed_end_string;
+  }
   while (p < ep && *p != '\"')
     p++;
   if (p >= ep) {
@@ -829,15 +838,21 @@ keyed_start_string:;
         goto keyed_start_string;
     }
   }
-  *p = 0;
+keyed_end_string:;
+  AJSON_VALIDATE_UTF8(stringp);
+  AJSON_TERMINATE(p);
   string_length = p - stringp;
   p++;
   ch = *p;
 
 keyed_add_string:;
-  j = (ajson_t *)aml_pool_alloc(pool, sizeof(ajson_t));
+  if (AJSON_CONVERT_NUMBER)
+    j = (ajson_t *)aml_pool_alloc(pool, sizeof(_ajson_number_t));
+  else
+    j = (ajson_t *)aml_pool_alloc(pool, sizeof(ajson_t));
   // j->parent = (ajson_t *)root;
   j->type = data_type;
+  j->flags = slice;
 #ifdef AJSON_DECODE_TEST
   if (data_type == AJSON_STRING)
     j->value = ajson_decode(pool, stringp, string_length);
@@ -847,7 +862,9 @@ keyed_add_string:;
   j->value = stringp;
 #endif
   j->length = string_length;
-  ajsono_append((ajson_t *)root, key, j, false);
+  if (AJSON_CONVERT_NUMBER)
+    _ajson_number_convert(j, stringp, string_length);
+  _ajsono_append((ajson_t *)root, key, key_length, key_hash, j, false);
 
 look_for_key:;
   switch (ch) {
@@ -881,6 +898,8 @@ look_for_key:;
 
   case AJSON_SPACE_CASE:
     p++;
+    if (ix)
+      p = _ajson_index_skip_space(ix, p);
     ch = *p;
     goto look_for_key;
   default:
@@ -918,7 +937,7 @@ keyed_next_digit:;
 
   // Step back to handle the end of the number properly
   p--;
-  *p = 0; // Null-terminate the string
+  AJSON_TERMINATE(p); // Null-terminate the string
 
   // At this point, the number is fully parsed
   data_type = AJSON_NUMBER;
@@ -960,7 +979,7 @@ keyed_decimal_number:;
 
   // Finalize the number parsing
   p--;           // Step back to handle the next character
-  *p = 0;        // Null-terminate the string
+  AJSON_TERMINATE(p); // Null-terminate the string
   data_type = AJSON_DECIMAL; // Assign the type
   string_length = p - stringp; // Calculate the length
   AJSON_KEYED_ADD_STRING;      // Add the number to the JSON structure
@@ -976,8 +995,18 @@ start_value:;
     data_type = AJSON_STRING;
     AJSON_START_STRING;
   case AJSON_SPACE_CASE:
+    if (ix)
+      p = _ajson_index_skip_space(ix, p);
     AJSON_START_VALUE;
   case '{':
+    if (slots) {
+      obj = (_ajsono_t *)aml_pool_zalloc(pool, sizeof(_ajsono_t));
+      if (arr)
+        ajsona_push_ref(slots, arr, (ajson_t *)obj);
+      else
+        res = (ajson_t *)obj;
+      goto start_array_object;
+    }
     anode = (ajsona_t *)aml_pool_zalloc(pool, sizeof(ajsona_t) +
                                                    sizeof(_ajsono_t));
     obj = (_ajsono_t *)(anode + 1);
@@ -993,6 +1022,7 @@ start_value:;
       }
     } else
       res = (ajson_t *)obj;
+  start_array_object:
     obj->type = AJSON_OBJECT;
     obj->pool = pool;
 
@@ -1000,6 +1030,14 @@ start_value:;
     root = obj;
     AJSON_START_KEY;
   case '[':
+    if (slots) {
+      arr2 = (_ajsona_t *)aml_pool_zalloc(pool, sizeof(_ajsona_t));
+      if (arr)
+        ajsona_push_ref(slots, arr, (ajson_t *)arr2);
+      else
+        res = (ajson_t *)arr2;
+      goto start_array_array;
+    }
     anode = (ajsona_t *)aml_pool_zalloc(pool, sizeof(ajsona_t) +
                                                    sizeof(_ajsona_t));
     arr2 = (_ajsona_t *)(anode + 1);
@@ -1015,6 +1053,7 @@ start_value:;
       }
     } else
       res = (ajson_t *)arr2;
+  start_array_array:
     arr2->type = AJSON_ARRAY;
     arr2->pool = pool;
     arr2->parent = (ajson_t *)arr;
@@ -1026,6 +1065,8 @@ start_value:;
 #ifdef AJSON_FILL_TEST
     _ajsona_fill(arr);
 #endif
+    if (slots)
+      ajsona_close_slots(slots, arr);
     root = (_ajsono_t *)arr->parent;
     if (!root)
       return res;
@@ -1138,6 +1179,8 @@ start_value:;
         data_type = AJSON_BINARY;
         stringp = p;
         p += string_length;
+        if (ix)
+          _ajson_index_reset(ix, p);
         ch = *p;
         AJSON_ADD_STRING;
       }
@@ -1163,6 +1206,13 @@ start_value:;
   };
 
 start_string:;
+  if (ix) {
+    p = _ajson_index_quote(ix, p);
+    if (p >= ep) {
+      AJSON_BAD_CHARACTER;
+    }
+    goto end_string;
+  }
   while (p < ep && *p != '\"')
     p++;
   if (p >= ep) {
@@ -1178,16 +1228,33 @@ start_string:;
         goto start_string;
     }
   }
-  *p = 0;
+end_string:;
+  AJSON_VALIDATE_UTF8(stringp);
+  AJSON_TERMINATE(p);
   string_length = p - stringp;
   p++;
   ch = *p;
 
 add_string:;
-  anode = (ajsona_t *)aml_pool_zalloc(pool,
-                                       sizeof(ajsona_t) + sizeof(ajson_t));
-  j = anode->value = (ajson_t *)(anode + 1);
+  if (AJSON_CONVERT_NUMBER) {
+    /* the converted value follows the node, so it is referenced even when
+       the array is contiguous */
+    j = (ajson_t *)aml_pool_alloc(pool, sizeof(_ajson_number_t));
+    if (slots && arr)
+      ajsona_push_ref(slots, arr, j);
+    else {
+      anode = (ajsona_t *)aml_pool_zalloc(pool, sizeof(ajsona_t));
+      anode->value = j;
+    }
+  } else if (slots && arr)
+    j = ajsona_push_value(slots, arr);
+  else {
+    anode = (ajsona_t *)aml_pool_zalloc(pool,
+                                         sizeof(ajsona_t) + sizeof(ajson_t));
+    j = anode->value = (ajson_t *)(anode + 1);
+  }
   j->type = data_type;
+  j->flags = slice;
 #ifdef AJSON_DECODE_TEST
   if (data_type == AJSON_STRING)
     j->value = ajson_decode(pool, stringp, string_length);
@@ -1198,9 +1265,21 @@ add_string:;
 #endif
   j->length = string_length;
   j->parent = (ajson_t *)arr;
-
-  if (!arr)
+  if (AJSON_CONVERT_NUMBER)
+    _ajson_number_convert(j, stringp, string_length);
+
+  if (!arr) {
+    /* a top level value has no parent to find the pool from */
+    if (slice && data_type >= AJSON_STRING) {
+      j->value = (char *)aml_pool_alloc(pool, string_length + 1);
+      memcpy(j->value, stringp, string_length);
+      j->value[string_length] = 0;
+      j->flags = 0;
+    }
     return j;
+  }
+  if (slots)
+    goto look_for_next_object;
 
   arr->num_entries++;
   if (!arr->head)
@@ -1224,6 +1303,8 @@ look_for_next_object:;
 #ifdef AJSON_FILL_TEST
     _ajsona_fill(arr);
 #endif
+    if (slots)
+      ajsona_close_slots(slots, arr);
     root = (_ajsono_t *)arr->parent;
     if (!root)
       return res;
@@ -1237,6 +1318,8 @@ look_for_next_object:;
     }
   case AJSON_SPACE_CASE:
     p++;
+    if (ix)
+      p = _ajson_index_skip_space(ix, p);
     ch = *p;
     goto look_for_next_object;
   default:
@@ -1285,7 +1368,7 @@ next_digit:;
 
   // Finalize the number parsing
   p--;           // Step back to handle the next character
-  *p = 0;        // Null-terminate the string
+  AJSON_TERMINATE(p); // Null-terminate the string
   data_type = AJSON_NUMBER; // Assign the type
   string_length = p - stringp; // Calculate the length
   AJSON_ADD_STRING;           // Add the number to the JSON structure
@@ -1325,7 +1408,7 @@ decimal_number:;
 
   // Finalize the number parsing
   p--;           // Step back to handle the next character
-  *p = 0;        // Null-terminate the string
+  AJSON_TERMINATE(p); // Null-terminate the string
   data_type = AJSON_DECIMAL; // Assign the type
   string_length = p - stringp; // Calculate the length
   AJSON_ADD_STRING;           // Add the number to the JSON structure
@@ -1334,6 +1417,7 @@ bad_character:;
   ajson_error_t *err =
       (ajson_error_t *)aml_pool_alloc(pool, sizeof(ajson_error_t));
   err->type = AJSON_ERROR;
+  err->flags = 0;
 #ifdef AJSON_DEBUG
   err->line = line;
   err->line2 = line2;
@@ -1343,11 +1427,53 @@ bad_character:;
 #endif
   err->error_at = p;
   err->source = sp;
+  err->pool = pool;
   return (ajson_t *)err;
 }
 
-static inline bool ajson_compare(const ajsono_t **a, const ajsono_t **b) {
-  return strcmp((*a)->key, (*b)->key) < 0;
+ajson_t *ajson_parse(aml_pool_t *pool, char *p, char *ep) {
+  return _ajson_parse(pool, p, ep, NULL, NULL, 0, false, false);
+}
+
+ajson_t *ajson_parse2(aml_pool_t *pool, char *p, char *ep, uint32_t options) {
+  ajson_index_t ix;
+  ajson_index_t *ixp = NULL;
+  aml_buffer_t *slots = NULL;
+  if (options & AJSON_PARSE_INDEXED) {
+    _ajson_index_init(&ix, p, ep);
+    ixp = &ix;
+  }
+  if (options & AJSON_PARSE_CONTIGUOUS_ARRAYS)
+    slots = aml_buffer_init(sizeof(ajsona_slot_t) * 64);
+  ajson_t *res = _ajson_parse(
+      pool, p, ep, ixp, slots,
+      (options & AJSON_PARSE_NON_DESTRUCTIVE) ? AJSON_SLICE : 0,
+      (options & AJSON_PARSE_NUMBERS) ? true : false,
+      (options & AJSON_PARSE_VALIDATE_UTF8) ? true : false);
+  if (slots)
+    aml_buffer_destroy(slots);
+  return res;
+}
+
+char *_ajson_terminate(ajson_t *j) {
+  aml_pool_t *pool;
+  ajson_t *parent = j->parent;
+  if (!parent)
+    return j->value;
+  if (parent->type == AJSON_OBJECT)
+    pool = ((_ajsono_t *)parent)->pool;
+  else
+    pool = ((_ajsona_t *)parent)->pool;
+  char *v = (char *)aml_pool_alloc(pool, j->length + 1);
+  memcpy(v, j->value, j->length);
+  v[j->length] = 0;
+  j->value = v;
+  j->flags &= ~AJSON_SLICE;
+  return v;
+}
+
+static inline bool ajson_compare(ajsono_t *const *a, ajsono_t *const *b) {
+  return ajsono_insert_compare(*a, *b) < 0;
 }
 
 macro_sort(__ajson_sort, ajsono_t *, ajson_compare);
@@ -1368,3 +1494,53 @@ void _ajsono_fill(_ajsono_t *o) {
   else
     o->root = NULL;
 }
+
+static void ajsono_hash_place(_ajsono_hash_t *h, ajsono_t *n, uint32_t hash) {
+  _ajsono_hash_slot_t *slots = h->slots;
+  uint32_t i = hash & h->mask;
+  while (slots[i].node) {
+    if (slots[i].hash == hash && slots[i].node->key_length == n->key_length &&
+        !memcmp(slots[i].node->key, n->key, n->key_length))
+      return;
+    i = (i + 1) & h->mask;
+  }
+  slots[i].node = n;
+  slots[i].hash = hash;
+  h->num_entries++;
+}
+
+static void ajsono_hash_alloc(_ajsono_t *o, size_t num_entries) {
+  uint32_t size = 8;
+  while (size < (num_entries << 1))
+    size <<= 1;
+  _ajsono_hash_t *h = o->hash;
+  if (!h)
+    h = o->hash = (_ajsono_hash_t *)aml_pool_alloc(o->pool, sizeof(*h));
+  h->mask = size - 1;
+  h->num_entries = 0;
+  h->slots = (_ajsono_hash_slot_t *)aml_pool_zalloc(
+      o->pool, sizeof(_ajsono_hash_slot_t) * size);
+}
+
+void _ajsono_fill_hash(_ajsono_t *o) {
+  ajsono_hash_alloc(o, o->num_entries);
+  _ajsono_hash_t *h = o->hash;
+  ajsono_t *n = o->head;
+  while (n) {
+    ajsono_hash_place(h, n, n->hash);
+    n = n->next;
+  }
+}
+
+void _ajsono_hash_add(_ajsono_t *o, ajsono_t *n) {
+  _ajsono_hash_t *h = o->hash;
+  if ((h->num_entries + 1) << 1 > h->mask + 1) {
+    _ajsono_hash_slot_t *slots = h->slots;
+    uint32_t size = h->mask + 1;
+    ajsono_hash_alloc(o, h->num_entries + 1);
+    for (uint32_t i = 0; i < size; i++)
+      if (slots[i].node)
+        ajsono_hash_place(h, slots[i].node, slots[i].hash);
+  }
+  ajsono_hash_place(h, n, n->hash);
+}
@@ -0,0 +1,463 @@
+/*
+Copyright 2019 Andy Curtis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "a-json-library/ajson.h"
+#include "ajson_simd.h"
+
+#include "a-memory-library/aml_buffer.h"
+#include "a-memory-library/aml_pool.h"
+
+#include <string.h>
+
+/* The escape kernels return a bit for each of 64 bytes which must be
+   escaped when encoding: the control characters (below 0x20), the quote,
+   the backslash, and the forward slash. */
+static uint64_t ajson_escape_mask_scalar(const char *s) {
+  uint64_t m = 0;
+  for (int i = 0; i < 64; i++) {
+    unsigned char c = (unsigned char)s[i];
+    if (c < 0x20 || c == '\"' || c == '\\' || c == '/')
+      m |= (uint64_t)1 << i;
+  }
+  return m;
+}
+
+/* the backslashes of 64 bytes, used to find the escapes when decoding */
+static uint64_t ajson_backslash_mask_scalar(const char *s) {
+  uint64_t m = 0;
+  for (int i = 0; i < 64; i++)
+    if (s[i] == '\\')
+      m |= (uint64_t)1 << i;
+  return m;
+}
+
+#if defined(AJSON_SIMD_X86)
+AJSON_TARGET("sse4.2")
+static uint64_t ajson_escape_mask_sse42(const char *s) {
+  __m128i q = _mm_set1_epi8('\"');
+  __m128i b = _mm_set1_epi8('\\');
+  __m128i sl = _mm_set1_epi8('/');
+  __m128i ctrl = _mm_set1_epi8(0x1F);
+  uint64_t m = 0;
+  for (int i = 0; i < 4; i++) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + (i << 4)));
+    __m128i e = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, q), _mm_cmpeq_epi8(v, b)),
+        _mm_or_si128(_mm_cmpeq_epi8(v, sl),
+                     _mm_cmpeq_epi8(_mm_max_epu8(v, ctrl), ctrl)));
+    m |= (uint64_t)(uint16_t)_mm_movemask_epi8(e) << (i << 4);
+  }
+  return m;
+}
+
+AJSON_TARGET("sse4.2")
+static uint64_t ajson_backslash_mask_sse42(const char *s) {
+  __m128i b = _mm_set1_epi8('\\');
+  uint64_t m = 0;
+  for (int i = 0; i < 4; i++) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + (i << 4)));
+    m |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, b))
+         << (i << 4);
+  }
+  return m;
+}
+
+AJSON_TARGET("avx2")
+static uint64_t ajson_escape_mask_avx2(const char *s) {
+  __m256i q = _mm256_set1_epi8('\"');
+  __m256i b = _mm256_set1_epi8('\\');
+  __m256i sl = _mm256_set1_epi8('/');
+  __m256i ctrl = _mm256_set1_epi8(0x1F);
+  uint64_t m = 0;
+  for (int i = 0; i < 2; i++) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + (i << 5)));
+    __m256i e = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, q), _mm256_cmpeq_epi8(v, b)),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, sl),
+                        _mm256_cmpeq_epi8(_mm256_max_epu8(v, ctrl), ctrl)));
+    m |= (uint64_t)(uint32_t)_mm256_movemask_epi8(e) << (i << 5);
+  }
+  return m;
+}
+
+AJSON_TARGET("avx2")
+static uint64_t ajson_backslash_mask_avx2(const char *s) {
+  __m256i b = _mm256_set1_epi8('\\');
+  __m256i lo = _mm256_loadu_si256((const __m256i *)s);
+  __m256i hi = _mm256_loadu_si256((const __m256i *)(s + 32));
+  return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, b)) |
+         ((uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, b))
+          << 32);
+}
+
+AJSON_TARGET("avx512f,avx512bw")
+static uint64_t ajson_escape_mask_avx512(const char *s) {
+  __m512i v = _mm512_loadu_si512((const void *)s);
+  return _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\"')) |
+         _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\\')) |
+         _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('/')) |
+         _mm512_cmplt_epu8_mask(v, _mm512_set1_epi8(0x20));
+}
+
+AJSON_TARGET("avx512f,avx512bw")
+static uint64_t ajson_backslash_mask_avx512(const char *s) {
+  __m512i v = _mm512_loadu_si512((const void *)s);
+  return _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\\'));
+}
+#elif defined(AJSON_SIMD_NEON)
+static inline uint64_t ajson_escape_neon_movemask(uint8x16_t v0,
+                                                  uint8x16_t v1,
+                                                  uint8x16_t v2,
+                                                  uint8x16_t v3) {
+  const uint8x16_t bits = {1, 2, 4, 8, 16, 32, 64, 128,
+                           1, 2, 4, 8, 16, 32, 64, 128};
+  uint8x16_t sum0 = vpaddq_u8(vandq_u8(v0, bits), vandq_u8(v1, bits));
+  uint8x16_t sum1 = vpaddq_u8(vandq_u8(v2, bits), vandq_u8(v3, bits));
+  sum0 = vpaddq_u8(sum0, sum1);
+  sum0 = vpaddq_u8(sum0, sum0);
+  return vgetq_lane_u64(vreinterpretq_u64_u8(sum0), 0);
+}
+
+static uint64_t ajson_escape_mask_neon(const char *s) {
+  uint8x16_t e[4];
+  for (int i = 0; i < 4; i++) {
+    uint8x16_t v = vld1q_u8((const uint8_t *)s + (i << 4));
+    e[i] = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('\"')),
+                             vceqq_u8(v, vdupq_n_u8('\\'))),
+                    vorrq_u8(vceqq_u8(v, vdupq_n_u8('/')),
+                             vcltq_u8(v, vdupq_n_u8(0x20))));
+  }
+  return ajson_escape_neon_movemask(e[0], e[1], e[2], e[3]);
+}
+
+static uint64_t ajson_backslash_mask_neon(const char *s) {
+  uint8x16_t e[4];
+  for (int i = 0; i < 4; i++)
+    e[i] = vceqq_u8(vld1q_u8((const uint8_t *)s + (i << 4)),
+                    vdupq_n_u8('\\'));
+  return ajson_escape_neon_movemask(e[0], e[1], e[2], e[3]);
+}
+#endif
+
+void _ajson_escape_select(ajson_simd_kernels_t *k, ajson_simd_t level) {
+  k->escape_mask = ajson_escape_mask_scalar;
+  k->backslash_mask = ajson_backslash_mask_scalar;
+#if defined(AJSON_SIMD_X86)
+  if (level == AJSON_SIMD_AVX512) {
+    k->escape_mask = ajson_escape_mask_avx512;
+    k->backslash_mask = ajson_backslash_mask_avx512;
+  } else if (level == AJSON_SIMD_AVX2) {
+    k->escape_mask = ajson_escape_mask_avx2;
+    k->backslash_mask = ajson_backslash_mask_avx2;
+  } else if (level == AJSON_SIMD_SSE42) {
+    k->escape_mask = ajson_escape_mask_sse42;
+    k->backslash_mask = ajson_backslash_mask_sse42;
+  }
+#elif defined(AJSON_SIMD_NEON)
+  if (level == AJSON_SIMD_NEON) {
+    k->escape_mask = ajson_escape_mask_neon;
+    k->backslash_mask = ajson_backslash_mask_neon;
+  }
+#endif
+}
+
+/* the mask of the (up to) 64 bytes at s, length is what remains.  The tail
+   is padded with a letter, which neither kernel marks. */
+static inline uint64_t ajson_escape_block(uint64_t (*mask)(const char *s),
+                                          const char *s, size_t length) {
+  if (length >= 64)
+    return mask(s);
+  char tail[64];
+  memset(tail, 'a', sizeof(tail));
+  memcpy(tail, s, length);
+  return mask(tail) & (((uint64_t)1 << length) - 1);
+}
+
+/* the letter of the two character escape of a control character, or 0 if
+   it is written as \u00XX */
+static const char ajson_escape_letter[32] = {
+    0, 0, 0,   0,   0, 0,   0,   0, 'b', 't', 'n', 0, 'f', 'r', 0, 0,
+    0, 0, 0,   0,   0, 0,   0,   0, 0,   0,   0,   0, 0,   0,   0, 0};
+
+static inline size_t ajson_escape_length(unsigned char c) {
+  return (c >= 0x20 || ajson_escape_letter[c]) ? 2 : 6;
+}
+
+static inline char *ajson_escape(char *wp, unsigned char c) {
+  static const char hex[] = "0123456789abcdef";
+  *wp++ = '\\';
+  if (c >= 0x20)
+    *wp++ = (char)c;
+  else if (ajson_escape_letter[c])
+    *wp++ = ajson_escape_letter[c];
+  else {
+    memcpy(wp, "u00", 3);
+    wp[3] = hex[c >> 4];
+    wp[4] = hex[c & 15];
+    wp += 5;
+  }
+  return wp;
+}
+
+/* The input is scanned twice, 64 bytes at a time.  The first pass finds
+   the first escape and the exact length of the result, and the second
+   copies the runs between escapes with memcpy.  Escapes are rare, so the
+   bits of each mask are visited one at a time. */
+static size_t ajson_escape_extra(const ajson_simd_kernels_t *k,
+                                 const char *s, size_t length,
+                                 size_t *first) {
+  size_t extra = 0;
+  *first = length;
+  for (size_t i = 0; i < length; i += 64) {
+    uint64_t m = ajson_escape_block(k->escape_mask, s + i, length - i);
+    while (m) {
+      size_t pos = i + __builtin_ctzll(m);
+      if (*first == length)
+        *first = pos;
+      extra += ajson_escape_length((unsigned char)s[pos]) - 1;
+      m &= m - 1;
+    }
+  }
+  return extra;
+}
+
+/* writes the encoded s to wp (which has room for it) */
+static void ajson_escape_copy(const ajson_simd_kernels_t *k, char *wp,
+                              const char *s, size_t length, size_t first) {
+  memcpy(wp, s, first);
+  wp += first;
+  size_t done = first;
+  for (size_t i = first; i < length; i += 64) {
+    uint64_t m = ajson_escape_block(k->escape_mask, s + i, length - i);
+    while (m) {
+      size_t pos = i + __builtin_ctzll(m);
+      memcpy(wp, s + done, pos - done);
+      wp += pos - done;
+      wp = ajson_escape(wp, (unsigned char)s[pos]);
+      done = pos + 1;
+      m &= m - 1;
+    }
+  }
+  memcpy(wp, s + done, length - done);
+}
+
+char *ajson_encode(aml_pool_t *pool, char *s, size_t length) {
+  const ajson_simd_kernels_t *k = _ajson_simd_kernels();
+  size_t first;
+  size_t extra = ajson_escape_extra(k, s, length, &first);
+  if (!extra) {
+    if (s[length] != 0) {
+      s = (char *)aml_pool_dup(pool, s, length + 1);
+      s[length] = 0;
+    }
+    return s;
+  }
+
+  char *res = (char *)aml_pool_alloc(pool, length + extra + 1);
+  ajson_escape_copy(k, res, s, length, first);
+  res[length + extra] = 0;
+  return res;
+}
+
+void _ajson_encode_to_buffer(aml_buffer_t *bh, const char *s, size_t length) {
+  const ajson_simd_kernels_t *k = _ajson_simd_kernels();
+  size_t first;
+  size_t extra = ajson_escape_extra(k, s, length, &first);
+  char *wp = (char *)aml_buffer_append_alloc(bh, length + extra);
+  if (!extra)
+    memcpy(wp, s, length);
+  else
+    ajson_escape_copy(k, wp, s, length, first);
+}
+
+/* The value of each hex digit, anything else is 16 */
+static const uint8_t ajson_hex[256] = {
+    16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+    16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+    16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 16, 16, 16, 16, 16, 16,
+    16, 10, 11, 12, 13, 14, 15, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+    16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+    16, 10, 11, 12, 13, 14, 15, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+    16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+    16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+    16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+    16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+    16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+    16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+    16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+    16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+    16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+};
+
+#define AJSON_BAD_ESCAPE 0xFFFFFFFF
+
+/* the value of four hex digits, or AJSON_BAD_ESCAPE if any is invalid */
+static inline uint32_t ajson_hex4(const char *p) {
+  const unsigned char *u = (const unsigned char *)p;
+  uint32_t a = ajson_hex[u[0]], b = ajson_hex[u[1]], c = ajson_hex[u[2]],
+           d = ajson_hex[u[3]];
+  if ((a | b | c | d) & 16)
+    return AJSON_BAD_ESCAPE;
+  return (a << 12) | (b << 8) | (c << 4) | d;
+}
+
+static inline char *ajson_utf8(char *rp, uint32_t ch) {
+  if (ch < 0x80)
+    *rp++ = (char)ch;
+  else if (ch < 0x800) {
+    *rp++ = (ch >> 6) | 0xC0;
+    *rp++ = (ch & 0x3F) | 0x80;
+  } else if (ch < 0x10000) {
+    *rp++ = (ch >> 12) | 0xE0;
+    *rp++ = ((ch >> 6) & 0x3F) | 0x80;
+    *rp++ = (ch & 0x3F) | 0x80;
+  } else {
+    *rp++ = (ch >> 18) | 0xF0;
+    *rp++ = ((ch >> 12) & 0x3F) | 0x80;
+    *rp++ = ((ch >> 6) & 0x3F) | 0x80;
+    *rp++ = (ch & 0x3F) | 0x80;
+  }
+  return rp;
+}
+
+/* Decodes the escape at p (a backslash) and returns the input position
+   after it.  A \u escape which is not valid (including a high surrogate
+   without its low half) is copied as is and an unknown escape is dropped. */
+static inline const char *ajson_unescape(char **rpp, const char *p,
+                                         const char *ep) {
+  char *rp = *rpp;
+  if (ep - p < 2)
+    return ep;
+  switch (p[1]) {
+  case '\"':
+    *rp++ = '\"';
+    break;
+  case '\\':
+    *rp++ = '\\';
+    break;
+  case '/':
+    *rp++ = '/';
+    break;
+  case 'b':
+    *rp++ = 8;
+    break;
+  case 'f':
+    *rp++ = 12;
+    break;
+  case 'n':
+    *rp++ = 10;
+    break;
+  case 'r':
+    *rp++ = 13;
+    break;
+  case 't':
+    *rp++ = 9;
+    break;
+  case 'u': {
+    uint32_t ch = AJSON_BAD_ESCAPE;
+    size_t len = 6;
+    if (ep - p >= 6)
+      ch = ajson_hex4(p + 2);
+    if (ch >= 0xD800 && ch <= 0xDBFF) {
+      uint32_t ch2 = AJSON_BAD_ESCAPE;
+      if (ep - p >= 12 && p[6] == '\\' && p[7] == 'u')
+        ch2 = ajson_hex4(p + 8);
+      if (ch2 >= 0xDC00 && ch2 <= 0xDFFF) {
+        ch = ((ch - 0xD800) << 10) + (ch2 - 0xDC00) + 0x10000;
+        len = 12;
+      } else
+        ch = AJSON_BAD_ESCAPE;
+    }
+    if (ch != AJSON_BAD_ESCAPE)
+      rp = ajson_utf8(rp, ch);
+    else {
+      if ((size_t)(ep - p) < len)
+        len = ep - p;
+      memcpy(rp, p, len);
+      rp += len;
+    }
+    *rpp = rp;
+    return p + len;
+  }
+  }
+  *rpp = rp;
+  return p + 2;
+}
+
+/* The first backslash is found 64 bytes at a time.  From there on, the runs
+   between escapes are copied with memcpy and each escape is decoded.  An
+   escape can consume backslashes later in the mask (or in the next block),
+   so those bits are skipped. */
+static char *ajson_decode_from(char **eptr, aml_pool_t *pool, char *s,
+                               size_t length) {
+  const ajson_simd_kernels_t *k = _ajson_simd_kernels();
+  const char *ep = s + length;
+  size_t i = 0;
+  uint64_t m = 0;
+  for (; i < length; i += 64) {
+    m = ajson_escape_block(k->backslash_mask, s + i, length - i);
+    if (m)
+      break;
+  }
+  if (!m)
+    return NULL;
+
+  size_t first = i + __builtin_ctzll(m);
+  char *res = (char *)aml_pool_alloc(pool, length + 1);
+  memcpy(res, s, first);
+  char *rp = res + first;
+  const char *done = s + first;
+  for (;;) {
+    while (m) {
+      const char *p = s + i + __builtin_ctzll(m);
+      m &= m - 1;
+      if (p < done)
+        continue;
+      memcpy(rp, done, p - done);
+      rp += p - done;
+      done = ajson_unescape(&rp, p, ep);
+    }
+    i += 64;
+    if (i >= length)
+      break;
+    m = ajson_escape_block(k->backslash_mask, s + i, length - i);
+  }
+  if (done < ep) {
+    memcpy(rp, done, ep - done);
+    rp += ep - done;
+  }
+  *rp = 0;
+  *eptr = rp;
+  return res;
+}
+
+char *ajson_decode(aml_pool_t *pool, char *s, size_t length) {
+  char *eptr;
+  char *r = ajson_decode_from(&eptr, pool, s, length);
+  return r ? r : s;
+}
+
+char *ajson_decode2(size_t *rlen, aml_pool_t *pool, char *s, size_t length) {
+  char *eptr;
+  char *r = ajson_decode_from(&eptr, pool, s, length);
+  if (!r) {
+    *rlen = length;
+    return s;
+  }
+  *rlen = eptr - r;
+  return r;
+}
@@ -0,0 +1,197 @@
+/*
+Copyright 2019 Andy Curtis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "ajson_index.h"
+#include "ajson_simd.h"
+
+#include <string.h>
+
+static void ajson_index_masks_scalar(const char *s, uint64_t *quotes,
+                                     uint64_t *backslashes, uint64_t *spaces) {
+  uint64_t qm = 0, bm = 0, wm = 0;
+  for (int i = 0; i < 64; i++) {
+    switch (s[i]) {
+    case '\"':
+      qm |= (uint64_t)1 << i;
+      break;
+    case '\\':
+      bm |= (uint64_t)1 << i;
+      break;
+    case 32:
+    case 9:
+    case 13:
+    case 10:
+      wm |= (uint64_t)1 << i;
+      break;
+    }
+  }
+  *quotes = qm;
+  *backslashes = bm;
+  *spaces = wm;
+}
+
+#if defined(AJSON_SIMD_X86)
+AJSON_TARGET("sse4.2")
+static void ajson_index_masks_sse42(const char *s, uint64_t *quotes,
+                                    uint64_t *backslashes, uint64_t *spaces) {
+  __m128i q = _mm_set1_epi8('\"');
+  __m128i b = _mm_set1_epi8('\\');
+  __m128i sp = _mm_set1_epi8(' ');
+  __m128i tab = _mm_set1_epi8('\t');
+  __m128i nl = _mm_set1_epi8('\n');
+  __m128i cr = _mm_set1_epi8('\r');
+  uint64_t qm = 0, bm = 0, wm = 0;
+  for (int i = 0; i < 4; i++) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + (i << 4)));
+    __m128i w = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, tab)),
+        _mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, cr)));
+    qm |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, q))
+          << (i << 4);
+    bm |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, b))
+          << (i << 4);
+    wm |= (uint64_t)(uint16_t)_mm_movemask_epi8(w) << (i << 4);
+  }
+  *quotes = qm;
+  *backslashes = bm;
+  *spaces = wm;
+}
+
+AJSON_TARGET("avx2")
+static void ajson_index_masks_avx2(const char *s, uint64_t *quotes,
+                                   uint64_t *backslashes, uint64_t *spaces) {
+  __m256i lo = _mm256_loadu_si256((const __m256i *)s);
+  __m256i hi = _mm256_loadu_si256((const __m256i *)(s + 32));
+  __m256i q = _mm256_set1_epi8('\"');
+  __m256i b = _mm256_set1_epi8('\\');
+  __m256i sp = _mm256_set1_epi8(' ');
+  __m256i tab = _mm256_set1_epi8('\t');
+  __m256i nl = _mm256_set1_epi8('\n');
+  __m256i cr = _mm256_set1_epi8('\r');
+
+  *quotes = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, q)) |
+            ((uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, q))
+             << 32);
+  *backslashes =
+      (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, b)) |
+      ((uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, b))
+       << 32);
+  __m256i wlo = _mm256_or_si256(
+      _mm256_or_si256(_mm256_cmpeq_epi8(lo, sp), _mm256_cmpeq_epi8(lo, tab)),
+      _mm256_or_si256(_mm256_cmpeq_epi8(lo, nl), _mm256_cmpeq_epi8(lo, cr)));
+  __m256i whi = _mm256_or_si256(
+      _mm256_or_si256(_mm256_cmpeq_epi8(hi, sp), _mm256_cmpeq_epi8(hi, tab)),
+      _mm256_or_si256(_mm256_cmpeq_epi8(hi, nl), _mm256_cmpeq_epi8(hi, cr)));
+  *spaces = (uint32_t)_mm256_movemask_epi8(wlo) |
+            ((uint64_t)(uint32_t)_mm256_movemask_epi8(whi) << 32);
+}
+
+AJSON_TARGET("avx512f,avx512bw")
+static void ajson_index_masks_avx512(const char *s, uint64_t *quotes,
+                                     uint64_t *backslashes, uint64_t *spaces) {
+  __m512i v = _mm512_loadu_si512((const void *)s);
+  *quotes = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\"'));
+  *backslashes = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\\'));
+  *spaces = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8(' ')) |
+            _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\t')) |
+            _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\n')) |
+            _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\r'));
+}
+#elif defined(AJSON_SIMD_NEON)
+static inline uint64_t ajson_index_neon_movemask(uint8x16_t v0, uint8x16_t v1,
+                                                 uint8x16_t v2, uint8x16_t v3) {
+  const uint8x16_t bits = {1, 2, 4, 8, 16, 32, 64, 128,
+                           1, 2, 4, 8, 16, 32, 64, 128};
+  uint8x16_t t0 = vandq_u8(v0, bits);
+  uint8x16_t t1 = vandq_u8(v1, bits);
+  uint8x16_t t2 = vandq_u8(v2, bits);
+  uint8x16_t t3 = vandq_u8(v3, bits);
+  uint8x16_t sum0 = vpaddq_u8(t0, t1);
+  uint8x16_t sum1 = vpaddq_u8(t2, t3);
+  sum0 = vpaddq_u8(sum0, sum1);
+  sum0 = vpaddq_u8(sum0, sum0);
+  return vgetq_lane_u64(vreinterpretq_u64_u8(sum0), 0);
+}
+
+static void ajson_index_masks_neon(const char *s, uint64_t *quotes,
+                                   uint64_t *backslashes, uint64_t *spaces) {
+  uint8x16_t v[4];
+  uint8x16_t qv[4], bv[4], wv[4];
+  for (int i = 0; i < 4; i++) {
+    v[i] = vld1q_u8((const uint8_t *)s + (i << 4));
+    qv[i] = vceqq_u8(v[i], vdupq_n_u8('\"'));
+    bv[i] = vceqq_u8(v[i], vdupq_n_u8('\\'));
+    wv[i] = vorrq_u8(vorrq_u8(vceqq_u8(v[i], vdupq_n_u8(' ')),
+                              vceqq_u8(v[i], vdupq_n_u8('\t'))),
+                     vorrq_u8(vceqq_u8(v[i], vdupq_n_u8('\n')),
+                              vceqq_u8(v[i], vdupq_n_u8('\r'))));
+  }
+  *quotes = ajson_index_neon_movemask(qv[0], qv[1], qv[2], qv[3]);
+  *backslashes = ajson_index_neon_movemask(bv[0], bv[1], bv[2], bv[3]);
+  *spaces = ajson_index_neon_movemask(wv[0], wv[1], wv[2], wv[3]);
+}
+#endif
+
+void _ajson_index_select(ajson_simd_kernels_t *k, ajson_simd_t level) {
+  k->index_masks = ajson_index_masks_scalar;
+#if defined(AJSON_SIMD_X86)
+  if (level == AJSON_SIMD_AVX512)
+    k->index_masks = ajson_index_masks_avx512;
+  else if (level == AJSON_SIMD_AVX2)
+    k->index_masks = ajson_index_masks_avx2;
+  else if (level == AJSON_SIMD_SSE42)
+    k->index_masks = ajson_index_masks_sse42;
+#elif defined(AJSON_SIMD_NEON)
+  if (level == AJSON_SIMD_NEON)
+    k->index_masks = ajson_index_masks_neon;
+#endif
+}
+
+/* Returns a bit for every character that is escaped by an odd length run of
+   backslashes.  A run that reaches the end of the block sets carry so that
+   the first character of the next block is treated as escaped. */
+static inline uint64_t ajson_index_escaped(uint64_t backslashes,
+                                           uint64_t *carry) {
+  const uint64_t even_bits = 0x5555555555555555ULL;
+  uint64_t escaped = *carry;
+  if (!backslashes) {
+    *carry = 0;
+    return escaped;
+  }
+  backslashes &= ~escaped;
+  uint64_t follows_escape = (backslashes << 1) | escaped;
+  uint64_t odd_sequence_starts = backslashes & ~even_bits & ~follows_escape;
+  uint64_t sequences_starting_on_even_bits;
+  *carry = __builtin_add_overflow(odd_sequence_starts, backslashes,
+                                  &sequences_starting_on_even_bits);
+  uint64_t invert_mask = sequences_starting_on_even_bits << 1;
+  return (even_bits ^ invert_mask) & follows_escape;
+}
+
+void _ajson_index_build(ajson_index_t *ix) {
+  const ajson_simd_kernels_t *k = _ajson_simd_kernels();
+  uint64_t quotes, backslashes, spaces;
+  if (ix->ep - ix->block >= 64)
+    k->index_masks(ix->block, &quotes, &backslashes, &spaces);
+  else {
+    char tail[64];
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, ix->block, ix->ep - ix->block);
+    k->index_masks(tail, &quotes, &backslashes, &spaces);
+  }
+  ix->quotes = quotes & ~ajson_index_escaped(backslashes, &ix->escape_carry);
+  ix->spaces = spaces;
+}
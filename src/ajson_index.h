@@ -0,0 +1,101 @@
+/*
+Copyright 2019 Andy Curtis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _ajson_index_H
+#define _ajson_index_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+/* The structural index is the first stage of ajson_parse2 when
+   AJSON_PARSE_INDEXED is set.  Input is classified 64 bytes at a time into a
+   bitmap of unescaped quotes and a bitmap of whitespace using the kernel
+   selected by ajson_simd_level.  Backslashes are resolved while the block
+   is built (the escape state is carried from one block to the next), so a
+   quote bit always marks the real end of a string.
+
+   There is no bitmap of structural characters ({}[]:,).  The parser reads
+   the character after each value anyway to decide where to go next, so
+   such a bitmap would only add a prefix-xor (to mask out the characters
+   inside strings) to every block without saving any work.
+
+   The index only ever moves forward and is built one block ahead of the
+   parser, so it does not need to be allocated and stays in cache. */
+typedef struct {
+  char *block;
+  char *ep;
+  uint64_t quotes;
+  uint64_t spaces;
+  uint64_t escape_carry;
+} ajson_index_t;
+
+/* classify the 64 bytes at ix->block (fewer if near ix->ep) */
+void _ajson_index_build(ajson_index_t *ix);
+
+static inline void _ajson_index_init(ajson_index_t *ix, char *p, char *ep) {
+  ix->block = p;
+  ix->ep = ep;
+  ix->escape_carry = 0;
+  if (p < ep)
+    _ajson_index_build(ix);
+  else
+    ix->quotes = ix->spaces = 0;
+}
+
+/* restart the index at p, used after the parser skips raw binary data */
+static inline void _ajson_index_reset(ajson_index_t *ix, char *p) {
+  _ajson_index_init(ix, p, ix->ep);
+}
+
+/* return the first unescaped quote at or after p, or ep */
+static inline char *_ajson_index_quote(ajson_index_t *ix, char *p) {
+  for (;;) {
+    size_t offs = p - ix->block;
+    if (offs < 64) {
+      uint64_t m = ix->quotes & ((~(uint64_t)0) << offs);
+      if (m)
+        return ix->block + __builtin_ctzll(m);
+    }
+    if (ix->block + 64 >= ix->ep)
+      return ix->ep;
+    ix->block += 64;
+    if (p < ix->block)
+      p = ix->block;
+    _ajson_index_build(ix);
+  }
+}
+
+/* return the first non-whitespace character at or after p, or ep */
+static inline char *_ajson_index_skip_space(ajson_index_t *ix, char *p) {
+  for (;;) {
+    size_t offs = p - ix->block;
+    if (offs < 64) {
+      uint64_t m = ~ix->spaces & ((~(uint64_t)0) << offs);
+      if (m) {
+        p = ix->block + __builtin_ctzll(m);
+        return p < ix->ep ? p : ix->ep;
+      }
+    }
+    if (ix->block + 64 >= ix->ep)
+      return ix->ep;
+    ix->block += 64;
+    if (p < ix->block)
+      p = ix->block;
+    _ajson_index_build(ix);
+  }
+}
+
+#endif
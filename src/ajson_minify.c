@@ -0,0 +1,92 @@
+/*
+Copyright 2019 Andy Curtis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "a-json-library/ajson.h"
+#include "ajson_index.h"
+
+#include "a-memory-library/aml_buffer.h"
+
+#include <string.h>
+
+/* return the first unescaped quote or whitespace at or after p, or ep */
+static inline char *ajson_minify_break(ajson_index_t *ix, char *p) {
+  for (;;) {
+    size_t offs = p - ix->block;
+    if (offs < 64) {
+      uint64_t m = (ix->quotes | ix->spaces) & ((~(uint64_t)0) << offs);
+      if (m) {
+        p = ix->block + __builtin_ctzll(m);
+        return p < ix->ep ? p : ix->ep;
+      }
+    }
+    if (ix->block + 64 >= ix->ep)
+      return ix->ep;
+    ix->block += 64;
+    if (p < ix->block)
+      p = ix->block;
+    _ajson_index_build(ix);
+  }
+}
+
+/* a binary value (nb, a 32-bit length, and the raw bytes) is copied as is,
+   and the index restarts after it */
+static char *ajson_minify_binary(aml_buffer_t *bh, ajson_index_t *ix, char *p,
+                                 char *ep) {
+  char *end = ep;
+  if (ep - p >= 6) {
+    uint32_t length;
+    memcpy(&length, p + 2, sizeof(length));
+    if ((size_t)(ep - p - 6) >= length)
+      end = p + 6 + length;
+  }
+  aml_buffer_append(bh, p, end - p);
+  _ajson_index_reset(ix, end);
+  return end;
+}
+
+/* The structural index finds the strings (copied whole) and the runs of
+   whitespace between them (dropped) 64 bytes at a time.  Everything else is
+   copied in runs. */
+void ajson_minify_to_buffer(aml_buffer_t *bh, const char *s, const char *e) {
+  char *p = (char *)s;
+  char *ep = (char *)e;
+  ajson_index_t ix;
+  _ajson_index_init(&ix, p, ep);
+  while (p < ep) {
+    p = _ajson_index_skip_space(&ix, p);
+    if (p >= ep)
+      break;
+    if (*p == '\"') {
+      char *q = _ajson_index_quote(&ix, p + 1);
+      q = q < ep ? q + 1 : ep;
+      aml_buffer_append(bh, p, q - p);
+      p = q;
+      continue;
+    }
+    char *q = ajson_minify_break(&ix, p);
+    char *r = p;
+    while ((r = (char *)memchr(r, 'n', q - r)) != NULL && r + 1 < ep &&
+           r[1] != 'b')
+      r++;
+    if (r && r + 1 < ep) {
+      aml_buffer_append(bh, p, r - p);
+      p = ajson_minify_binary(bh, &ix, r, ep);
+      continue;
+    }
+    aml_buffer_append(bh, p, q - p);
+    p = q;
+  }
+}
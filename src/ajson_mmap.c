@@ -0,0 +1,107 @@
+/*
+Copyright 2019 Andy Curtis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "a-json-library/ajson.h"
+
+#include "a-memory-library/aml_alloc.h"
+#include "a-memory-library/aml_pool.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct ajson_mmap_s {
+  ajson_t *root;
+  char *data;
+  size_t length;     /* length of the file */
+  size_t map_length; /* length of the mapping (including the zero page) */
+};
+
+ajson_t *ajson_parse_file(aml_pool_t *pool, const char *filename,
+                          uint32_t options) {
+  FILE *in = fopen(filename, "rb");
+  if (!in)
+    return NULL;
+  struct stat st;
+  if (fstat(fileno(in), &st) || !S_ISREG(st.st_mode)) {
+    fclose(in);
+    return NULL;
+  }
+  size_t length = st.st_size;
+  char *p = (char *)aml_pool_alloc(pool, length + 1);
+  if (fread(p, 1, length, in) != length) {
+    fclose(in);
+    return NULL;
+  }
+  fclose(in);
+  p[length] = 0;
+  return ajson_parse2(pool, p, p + length, options);
+}
+
+ajson_mmap_t *ajson_parse_mmap(aml_pool_t *pool, const char *filename,
+                               uint32_t options) {
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+  struct stat st;
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return NULL;
+  }
+  size_t length = st.st_size;
+
+  /* The parser expects the byte at the end of the input to be readable (as
+     it is when the input is zero terminated).  If the file is a multiple of
+     the page size, that byte would be past the end of the file, so an
+     anonymous zero filled region one page larger than the file is reserved
+     first and the file is mapped over the start of it. */
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t map_length = ((length / page_size) + 1) * page_size;
+  char *data = (char *)mmap(NULL, map_length, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (data == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+  if (length &&
+      mmap(data, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd,
+           0) == MAP_FAILED) {
+    munmap(data, map_length);
+    close(fd);
+    return NULL;
+  }
+  close(fd);
+
+  /* the parser makes one forward pass over the input */
+  if (length)
+    madvise(data, length, MADV_SEQUENTIAL);
+
+  ajson_mmap_t *m = (ajson_mmap_t *)aml_malloc(sizeof(ajson_mmap_t));
+  m->data = data;
+  m->length = length;
+  m->map_length = map_length;
+  m->root = ajson_parse2(pool, data, data + length, options);
+  return m;
+}
+
+ajson_t *ajson_mmap_root(ajson_mmap_t *m) { return m->root; }
+
+void ajson_mmap_destroy(ajson_mmap_t *m) {
+  munmap(m->data, m->map_length);
+  aml_free(m);
+}
@@ -0,0 +1,242 @@
+/*
+Copyright 2019 Andy Curtis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "a-json-library/ajson.h"
+
+#include "a-memory-library/aml_alloc.h"
+#include "a-memory-library/aml_buffer.h"
+#include "a-memory-library/aml_pool.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Each worker claims roughly this many bytes at a time (extended to the end
+   of the line).  It is large enough to amortize the locking and small
+   enough that the work is spread evenly. */
+#define AJSON_NDJSON_BATCH_SIZE (1024 * 1024)
+
+/* The file is read in blocks of at least this size */
+#define AJSON_NDJSON_BLOCK_SIZE (64 * 1024 * 1024)
+
+typedef struct {
+  ajson_t *json;
+  size_t offset;
+} ajson_ndjson_record_t;
+
+typedef struct {
+  char *base;
+  char *p;
+  char *ep;
+  size_t base_offset;
+  uint32_t options;
+  bool ordered;
+  ajson_ndjson_cb cb;
+  void *arg;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  size_t next_batch;
+  size_t next_delivery;
+  size_t num_records;
+} ajson_ndjson_t;
+
+/* claim the next batch, returns false when the input is exhausted */
+static bool ajson_ndjson_next(ajson_ndjson_t *h, char **sp, char **ep,
+                              size_t *id) {
+  pthread_mutex_lock(&h->mutex);
+  if (h->p >= h->ep) {
+    pthread_mutex_unlock(&h->mutex);
+    return false;
+  }
+  char *s = h->p;
+  char *e = s + AJSON_NDJSON_BATCH_SIZE;
+  if (e >= h->ep)
+    e = h->ep;
+  else {
+    /* json does not allow raw newlines within strings, so every newline
+       is a record boundary.  memchr is vectorized by the c library. */
+    char *nl = (char *)memchr(e, '\n', h->ep - e);
+    e = nl ? nl + 1 : h->ep;
+  }
+  h->p = e;
+  *sp = s;
+  *ep = e;
+  *id = h->next_batch;
+  h->next_batch++;
+  pthread_mutex_unlock(&h->mutex);
+  return true;
+}
+
+static void *ajson_ndjson_worker(void *arg) {
+  ajson_ndjson_t *h = (ajson_ndjson_t *)arg;
+  aml_pool_t *pool = aml_pool_init(65536);
+  aml_buffer_t *records = aml_buffer_init(sizeof(ajson_ndjson_record_t) * 64);
+  char *p, *ep;
+  size_t id;
+  while (ajson_ndjson_next(h, &p, &ep, &id)) {
+    size_t num_records = 0;
+    while (p < ep) {
+      char *le = (char *)memchr(p, '\n', ep - p);
+      if (!le)
+        le = ep;
+      char *s = p;
+      while (s < le && (*s == ' ' || *s == '\t' || *s == '\r'))
+        s++;
+      if (s < le) {
+        ajson_ndjson_record_t r;
+        r.json = ajson_parse2(pool, s, le, h->options);
+        r.offset = h->base_offset + (p - h->base);
+        num_records++;
+        if (h->ordered)
+          aml_buffer_append(records, &r, sizeof(r));
+        else {
+          h->cb(r.json, r.offset, pool, h->arg);
+          aml_pool_clear(pool);
+        }
+      }
+      p = le + 1;
+    }
+
+    pthread_mutex_lock(&h->mutex);
+    if (h->ordered) {
+      while (h->next_delivery != id)
+        pthread_cond_wait(&h->cond, &h->mutex);
+      pthread_mutex_unlock(&h->mutex);
+
+      ajson_ndjson_record_t *r =
+          (ajson_ndjson_record_t *)aml_buffer_data(records);
+      for (size_t i = 0; i < num_records; i++)
+        h->cb(r[i].json, r[i].offset, pool, h->arg);
+      aml_buffer_clear(records);
+      aml_pool_clear(pool);
+
+      pthread_mutex_lock(&h->mutex);
+      h->next_delivery++;
+      pthread_cond_broadcast(&h->cond);
+    }
+    h->num_records += num_records;
+    pthread_mutex_unlock(&h->mutex);
+  }
+  aml_buffer_destroy(records);
+  aml_pool_destroy(pool);
+  return NULL;
+}
+
+static size_t ajson_ndjson_run(char *p, char *ep, size_t base_offset,
+                               int num_threads, uint32_t options, bool ordered,
+                               ajson_ndjson_cb cb, void *arg) {
+  ajson_ndjson_t h;
+  memset(&h, 0, sizeof(h));
+  h.base = h.p = p;
+  h.ep = ep;
+  h.base_offset = base_offset;
+  h.options = options;
+  h.ordered = ordered;
+  h.cb = cb;
+  h.arg = arg;
+  pthread_mutex_init(&h.mutex, NULL);
+  pthread_cond_init(&h.cond, NULL);
+
+  /* don't start more threads than there are batches */
+  size_t num_batches = ((ep - p) / AJSON_NDJSON_BATCH_SIZE) + 1;
+  if ((size_t)num_threads > num_batches)
+    num_threads = num_batches;
+
+  /* the calling thread is one of the workers */
+  pthread_t *threads = NULL;
+  if (num_threads > 1)
+    threads = (pthread_t *)aml_malloc(sizeof(pthread_t) * (num_threads - 1));
+  int started = 0;
+  for (int i = 0; i < num_threads - 1; i++) {
+    if (pthread_create(threads + i, NULL, ajson_ndjson_worker, &h))
+      break;
+    started++;
+  }
+  ajson_ndjson_worker(&h);
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  if (threads)
+    aml_free(threads);
+
+  pthread_cond_destroy(&h.cond);
+  pthread_mutex_destroy(&h.mutex);
+  return h.num_records;
+}
+
+static int ajson_ndjson_threads(int num_threads) {
+  if (num_threads > 0)
+    return num_threads;
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+}
+
+size_t ajson_ndjson(char *p, char *ep, int num_threads, uint32_t options,
+                    bool ordered, ajson_ndjson_cb cb, void *arg) {
+  return ajson_ndjson_run(p, ep, 0, ajson_ndjson_threads(num_threads),
+                          options, ordered, cb, arg);
+}
+
+size_t ajson_ndjson_file(const char *filename, int num_threads,
+                         uint32_t options, bool ordered, ajson_ndjson_cb cb,
+                         void *arg) {
+  FILE *in = fopen(filename, "rb");
+  if (!in)
+    return (size_t)-1;
+
+  num_threads = ajson_ndjson_threads(num_threads);
+
+  /* Each block ends at the last newline read.  The partial line after it is
+     moved to the front of the buffer and completed by the next read.  The
+     buffer grows if a single line does not fit. */
+  size_t size = AJSON_NDJSON_BLOCK_SIZE;
+  char *buf = (char *)aml_malloc(size + 1);
+  size_t length = 0;
+  size_t offset = 0;
+  size_t num_records = 0;
+  while (true) {
+    if (length == size) {
+      size *= 2;
+      buf = (char *)aml_realloc(buf, size + 1);
+    }
+    size_t n = fread(buf + length, 1, size - length, in);
+    length += n;
+    if (n == 0) {
+      if (length) {
+        buf[length] = 0;
+        num_records += ajson_ndjson_run(buf, buf + length, offset,
+                                        num_threads, options, ordered, cb,
+                                        arg);
+      }
+      break;
+    }
+    char *ep = buf + length;
+    char *nl = ep;
+    while (nl > buf && nl[-1] != '\n')
+      nl--;
+    if (nl == buf)
+      continue;
+    num_records += ajson_ndjson_run(buf, nl, offset, num_threads, options,
+                                    ordered, cb, arg);
+    offset += nl - buf;
+    length = ep - nl;
+    memmove(buf, nl, length);
+  }
+  aml_free(buf);
+  fclose(in);
+  return num_records;
+}
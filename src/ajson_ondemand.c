@@ -0,0 +1,569 @@
+/*
+Copyright 2019 Andy Curtis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "a-json-library/ajson.h"
+
+#include "a-memory-library/aml_buffer.h"
+#include "a-memory-library/aml_pool.h"
+
+#include <stdio.h>
+#include <string.h>
+
+struct ajson_ondemand_s {
+  aml_pool_t *pool;
+  char *p;        /* the first byte of the value */
+  char *ep;       /* the end of the input */
+  ajson_t *value; /* set once the value is created */
+};
+
+static inline char *ajson_ondemand_space(char *p, char *ep) {
+  while (p < ep && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t'))
+    p++;
+  return p;
+}
+
+static inline bool ajson_ondemand_delimiter(char ch) {
+  switch (ch) {
+  case ',':
+  case '}':
+  case ']':
+  case ' ':
+  case '\n':
+  case '\r':
+  case '\t':
+    return true;
+  default:
+    return false;
+  }
+}
+
+/* p is just after the opening quote, returns the closing quote */
+static char *ajson_ondemand_string_end(char *p, char *ep) {
+  while (p < ep) {
+    char *q = (char *)memchr(p, '\"', ep - p);
+    if (!q)
+      return NULL;
+    // if odd number of \, then skip "
+    char *b = q;
+    while (b > p && b[-1] == '\\')
+      b--;
+    if (((q - b) & 1) == 0)
+      return q;
+    p = q + 1;
+  }
+  return NULL;
+}
+
+/* p is on the n of nb (see ajson_dump_to_buffer) */
+static char *ajson_ondemand_binary_end(char *p, char *ep) {
+  uint32_t length;
+  if (ep - p < 6)
+    return NULL;
+  memcpy(&length, p + 2, sizeof(length));
+  if ((size_t)(ep - p - 6) < length)
+    return NULL;
+  return p + 6 + length;
+}
+
+/* p is on an opening bracket, returns the byte after the matching bracket.
+   If stack is not NULL, the brackets are checked to be of the same type
+   (this is only needed once, in ajson_ondemand). */
+static char *ajson_ondemand_match(char *p, char *ep, aml_buffer_t *stack) {
+  size_t depth = 0;
+  while (p < ep) {
+    switch (*p) {
+    case '\"':
+      p = ajson_ondemand_string_end(p + 1, ep);
+      if (!p)
+        return NULL;
+      break;
+    case '{':
+    case '[':
+      if (stack)
+        aml_buffer_appendc(stack, *p == '{' ? '}' : ']');
+      depth++;
+      break;
+    case '}':
+    case ']':
+      if (stack) {
+        size_t length = aml_buffer_length(stack);
+        if (!length || aml_buffer_data(stack)[length - 1] != *p)
+          return NULL;
+        aml_buffer_resize(stack, length - 1);
+      }
+      depth--;
+      if (!depth)
+        return p + 1;
+      break;
+    case 'n':
+      if (p + 1 < ep && p[1] == 'b') {
+        p = ajson_ondemand_binary_end(p, ep);
+        if (!p)
+          return NULL;
+        continue;
+      }
+      break;
+    }
+    p++;
+  }
+  return NULL;
+}
+
+/* returns the byte after the value which starts at p */
+static char *ajson_ondemand_skip(char *p, char *ep) {
+  if (*p == '{' || *p == '[')
+    return ajson_ondemand_match(p, ep, NULL);
+  if (*p == '\"') {
+    p = ajson_ondemand_string_end(p + 1, ep);
+    return p ? p + 1 : NULL;
+  }
+  if (*p == 'n' && p + 1 < ep && p[1] == 'b')
+    return ajson_ondemand_binary_end(p, ep);
+  while (p < ep && !ajson_ondemand_delimiter(*p))
+    p++;
+  return p;
+}
+
+/* returns the start of the value after the one at p in an array or NULL if
+   it was the last */
+static char *ajson_ondemand_next_element(char *p, char *ep) {
+  p = ajson_ondemand_skip(p, ep);
+  if (!p)
+    return NULL;
+  p = ajson_ondemand_space(p, ep);
+  if (p >= ep || *p != ',')
+    return NULL;
+  p = ajson_ondemand_space(p + 1, ep);
+  if (p >= ep || *p == ']')
+    return NULL;
+  return p;
+}
+
+static char *ajson_ondemand_first_element(ajson_ondemand_t *o) {
+  if (*o->p != '[')
+    return NULL;
+  char *p = ajson_ondemand_space(o->p + 1, o->ep);
+  if (p >= o->ep || *p == ']')
+    return NULL;
+  return p;
+}
+
+static ajson_ondemand_t *ajson_ondemand_cursor(aml_pool_t *pool, char *p,
+                                               char *ep) {
+  ajson_ondemand_t *o =
+      (ajson_ondemand_t *)aml_pool_alloc(pool, sizeof(ajson_ondemand_t));
+  o->pool = pool;
+  o->p = p;
+  o->ep = ep;
+  o->value = NULL;
+  return o;
+}
+
+ajson_ondemand_t *ajson_ondemand(aml_pool_t *pool, char *p, char *ep) {
+  p = ajson_ondemand_space(p, ep);
+  if (p >= ep || (*p != '{' && *p != '['))
+    return NULL;
+  aml_buffer_t *stack = aml_buffer_init(64);
+  char *end = ajson_ondemand_match(p, ep, stack);
+  aml_buffer_destroy(stack);
+  if (!end)
+    return NULL;
+  return ajson_ondemand_cursor(pool, p, end);
+}
+
+ajson_type_t ajson_ondemand_type(ajson_ondemand_t *o) {
+  char *p = o->p;
+  switch (*p) {
+  case '{':
+    return object;
+  case '[':
+    return array;
+  case '\"':
+    return string;
+  case 't':
+    return bool_true;
+  case 'f':
+    return bool_false;
+  case 'n':
+    return (p + 1 < o->ep && p[1] == 'b') ? binary : null;
+  default: {
+    char *ep = ajson_ondemand_skip(p, o->ep);
+    if (*p == '-')
+      p++;
+    if (ep - p == 1 && *p == '0')
+      return zero;
+    return memchr(p, '.', ep - p) ? decimal : number;
+  }
+  }
+}
+
+/* p is on the opening brace, returns the value of key or NULL */
+static char *ajson_ondemand_find(char *p, char *ep, const char *key,
+                                 size_t key_length) {
+  p++;
+  while (true) {
+    p = ajson_ondemand_space(p, ep);
+    if (p >= ep || *p != '\"')
+      return NULL;
+    char *sp = p + 1;
+    char *kp = ajson_ondemand_string_end(sp, ep);
+    if (!kp)
+      return NULL;
+    p = ajson_ondemand_space(kp + 1, ep);
+    if (p >= ep || *p != ':')
+      return NULL;
+    p = ajson_ondemand_space(p + 1, ep);
+    if (p >= ep)
+      return NULL;
+    if ((size_t)(kp - sp) == key_length && !memcmp(sp, key, key_length))
+      return p;
+    p = ajson_ondemand_skip(p, ep);
+    if (!p)
+      return NULL;
+    p = ajson_ondemand_space(p, ep);
+    if (p >= ep || *p != ',')
+      return NULL;
+    p++;
+  }
+}
+
+ajson_ondemand_t *ajson_ondemand_get(ajson_ondemand_t *o, const char *key) {
+  if (!o || *o->p != '{')
+    return NULL;
+  char *p = ajson_ondemand_find(o->p, o->ep, key, strlen(key));
+  return p ? ajson_ondemand_cursor(o->pool, p, o->ep) : NULL;
+}
+
+ajson_ondemand_t *ajson_ondemand_nth(ajson_ondemand_t *o, size_t n) {
+  if (!o)
+    return NULL;
+  char *p = ajson_ondemand_first_element(o);
+  while (p && n) {
+    p = ajson_ondemand_next_element(p, o->ep);
+    n--;
+  }
+  return p ? ajson_ondemand_cursor(o->pool, p, o->ep) : NULL;
+}
+
+ajson_ondemand_t *ajson_ondemand_path(ajson_ondemand_t *o, const char *path) {
+  if (!o)
+    return NULL;
+  size_t num_paths = 0;
+  char **paths =
+      aml_pool_split_with_escape2(o->pool, &num_paths, '.', '\\', path);
+  for (size_t i = 0; i < num_paths; i++) {
+    if (*o->p == '[') {
+      char *value = strchr(paths[i], '=');
+      if (value) {
+        *value = 0;
+        value++;
+        ajson_ondemand_t *next = NULL;
+        char *p = ajson_ondemand_first_element(o);
+        while (p) {
+          ajson_ondemand_t *e = ajson_ondemand_cursor(o->pool, p, o->ep);
+          char *v = ajsonv(ajson_ondemand_value(ajson_ondemand_get(e, paths[i])));
+          if (v && !strcmp(v, value)) {
+            next = e;
+            break;
+          }
+          p = ajson_ondemand_next_element(p, o->ep);
+        }
+        o = next;
+      } else {
+        size_t num = 0;
+        if (sscanf(paths[i], "%lu", &num) != 1)
+          return NULL;
+        o = ajson_ondemand_nth(o, num);
+      }
+    } else
+      o = ajson_ondemand_get(o, paths[i]);
+
+    if (!o)
+      return NULL;
+  }
+  return o;
+}
+
+/* the characters of a number (ajson_parse checks them no further) */
+static bool ajson_ondemand_number(const char *p, const char *ep) {
+  if (p >= ep || (*p != '-' && (*p < '0' || *p > '9')))
+    return false;
+  for (const char *s = p + 1; s < ep; s++) {
+    if (!((*s >= '0' && *s <= '9') || *s == '.' || *s == 'e' || *s == 'E' ||
+          *s == '+' || *s == '-'))
+      return false;
+  }
+  return true;
+}
+
+ajson_t *ajson_ondemand_value(ajson_ondemand_t *o) {
+  if (!o)
+    return NULL;
+  if (o->value)
+    return o->value;
+  char *p = o->p;
+  char *ep = ajson_ondemand_skip(p, o->ep);
+  if (!ep)
+    return NULL;
+  aml_pool_t *pool = o->pool;
+  ajson_t *j = NULL;
+  size_t length = ep - p;
+  switch (*p) {
+  case '{':
+  case '[':
+    j = ajson_parse2(pool, p, ep, AJSON_PARSE_NON_DESTRUCTIVE);
+    if (ajson_is_error(j))
+      return NULL;
+    break;
+  case '\"': {
+    char *s = (char *)aml_pool_alloc(pool, length - 1);
+    memcpy(s, p + 1, length - 2);
+    s[length - 2] = 0;
+    j = ajson_string(pool, s, length - 2);
+    break;
+  }
+  case 't':
+    if (length == 4 && !memcmp(p, "true", 4))
+      j = ajson_true(pool);
+    break;
+  case 'f':
+    if (length == 5 && !memcmp(p, "false", 5))
+      j = ajson_false(pool);
+    break;
+  case 'n':
+    if (length == 4 && !memcmp(p, "null", 4))
+      j = ajson_null(pool);
+    else if (p + 1 < ep && p[1] == 'b')
+      j = ajson_binary(pool, p + 6, length - 6);
+    break;
+  default: {
+    if (!ajson_ondemand_number(p, ep))
+      return NULL;
+    ajson_type_t type = ajson_ondemand_type(o);
+    if (type == zero) {
+      j = ajson_zero(pool);
+      break;
+    }
+    j = (ajson_t *)aml_pool_alloc(pool, sizeof(ajson_t) + length + 1);
+    j->parent = NULL;
+    j->flags = 0;
+    j->type = type == decimal ? AJSON_DECIMAL : AJSON_NUMBER;
+    j->value = (char *)(j + 1);
+    memcpy(j->value, p, length);
+    j->value[length] = 0;
+    j->length = length;
+    break;
+  }
+  }
+  o->value = j;
+  return j;
+}
+
+/* The paths given to ajson_parse_projected are merged into a tree with one
+   node per path segment.  A leaf selects the whole value. */
+typedef struct ajson_projection_s {
+  char *segment;
+  char *key;   /* for key=value array selectors */
+  char *value;
+  size_t key_length;
+  size_t value_length;
+  size_t index; /* for numeric array selectors */
+  bool is_index;
+  bool leaf;
+  struct ajson_projection_s *children;
+  struct ajson_projection_s *next;
+} ajson_projection_t;
+
+static void ajson_projection_add(aml_pool_t *pool, ajson_projection_t *root,
+                                 const char *path) {
+  size_t num_paths = 0;
+  char **paths =
+      aml_pool_split_with_escape2(pool, &num_paths, '.', '\\', path);
+  ajson_projection_t *node = root;
+  for (size_t i = 0; i < num_paths && !node->leaf; i++) {
+    ajson_projection_t *child = node->children;
+    while (child && strcmp(child->segment, paths[i]))
+      child = child->next;
+    if (!child) {
+      child = (ajson_projection_t *)aml_pool_zalloc(
+          pool, sizeof(ajson_projection_t));
+      child->segment = paths[i];
+      char *value = strchr(paths[i], '=');
+      if (value) {
+        child->key = aml_pool_strdup(pool, paths[i]);
+        child->key[value - paths[i]] = 0;
+        child->value = child->key + (value - paths[i]) + 1;
+        child->key_length = value - paths[i];
+        child->value_length = strlen(child->value);
+        /* keep the key that was matched so ajsono_path can select the
+           same element in the projected tree */
+        ajson_projection_t *match = (ajson_projection_t *)aml_pool_zalloc(
+            pool, sizeof(ajson_projection_t));
+        match->segment = child->key;
+        match->leaf = true;
+        child->children = match;
+      } else
+        child->is_index = sscanf(paths[i], "%lu", &child->index) == 1;
+      child->next = node->children;
+      node->children = child;
+    }
+    node = child;
+  }
+  /* a path which is a prefix of another selects everything below it */
+  node->leaf = true;
+  node->children = NULL;
+}
+
+static ajson_t *ajson_project_value(aml_pool_t *pool, char *p, char *ep,
+                                    ajson_projection_t *node);
+
+static ajson_t *ajson_project_object(aml_pool_t *pool, char *p, char *ep,
+                                     ajson_projection_t *node) {
+  ajson_t *obj = ajsono(pool);
+  p++;
+  while (true) {
+    p = ajson_ondemand_space(p, ep);
+    if (p >= ep || *p != '\"')
+      return obj;
+    char *sp = p + 1;
+    char *kp = ajson_ondemand_string_end(sp, ep);
+    if (!kp)
+      return NULL;
+    p = ajson_ondemand_space(kp + 1, ep);
+    if (p >= ep || *p != ':')
+      return NULL;
+    p = ajson_ondemand_space(p + 1, ep);
+    if (p >= ep)
+      return NULL;
+    size_t key_length = kp - sp;
+    ajson_projection_t *child = node->children;
+    while (child && (strlen(child->segment) != key_length ||
+                     memcmp(child->segment, sp, key_length)))
+      child = child->next;
+    if (child) {
+      ajson_t *value = ajson_project_value(pool, p, ep, child);
+      if (value)
+        ajsono_append(obj, child->segment, value, false);
+    }
+    p = ajson_ondemand_skip(p, ep);
+    if (!p)
+      return NULL;
+    p = ajson_ondemand_space(p, ep);
+    if (p >= ep || *p != ',')
+      return obj;
+    p++;
+  }
+}
+
+/* Compares the value at p with the text of a key=value selector the same
+   way ajson_ondemand_path does (against ajsonv of the value), but on the
+   input itself, so nothing is allocated for elements which do not match.
+   Strings are compared still encoded, null, binary values, objects, and
+   arrays never match, and -0 is the zero "0". */
+static bool ajson_project_equal(char *p, char *ep, const char *value,
+                                size_t value_length) {
+  char *vep = ajson_ondemand_skip(p, ep);
+  if (!vep)
+    return false;
+  switch (*p) {
+  case '\"':
+    p++;
+    vep--;
+    break;
+  case 't':
+  case 'f':
+    if (!(vep - p == 4 && !memcmp(p, "true", 4)) &&
+        !(vep - p == 5 && !memcmp(p, "false", 5)))
+      return false;
+    break;
+  case '{':
+  case '[':
+  case 'n':
+    return false;
+  default:
+    if (!ajson_ondemand_number(p, vep))
+      return false;
+    if (vep - p == 2 && p[0] == '-' && p[1] == '0')
+      p++;
+    break;
+  }
+  return (size_t)(vep - p) == value_length && !memcmp(p, value, value_length);
+}
+
+static bool ajson_project_element(char *p, char *ep, ajson_projection_t *child,
+                                  size_t index) {
+  if (child->key) {
+    if (*p != '{')
+      return false;
+    char *v = ajson_ondemand_find(p, ep, child->key, child->key_length);
+    return v && ajson_project_equal(v, ep, child->value, child->value_length);
+  }
+  return child->is_index && child->index == index;
+}
+
+/* Elements which are not selected before the last selected element are
+   replaced with null so that indexes in paths still refer to the same
+   element. */
+static ajson_t *ajson_project_array(aml_pool_t *pool, char *p, char *ep,
+                                    ajson_projection_t *node) {
+  ajson_t *arr = ajsona(pool);
+  size_t index = 0, num_entries = 0;
+  char *e = ajson_ondemand_space(p + 1, ep);
+  if (e >= ep || *e == ']')
+    return arr;
+  while (e) {
+    ajson_projection_t *child = node->children;
+    while (child && !ajson_project_element(e, ep, child, index))
+      child = child->next;
+    if (child) {
+      ajson_t *value = ajson_project_value(pool, e, ep, child);
+      if (value) {
+        for (; num_entries < index; num_entries++)
+          ajsona_append(arr, ajson_null(pool));
+        ajsona_append(arr, value);
+        num_entries++;
+      }
+    }
+    e = ajson_ondemand_next_element(e, ep);
+    index++;
+  }
+  return arr;
+}
+
+static ajson_t *ajson_project_value(aml_pool_t *pool, char *p, char *ep,
+                                    ajson_projection_t *node) {
+  if (node->leaf)
+    return ajson_ondemand_value(ajson_ondemand_cursor(pool, p, ep));
+  if (*p == '{')
+    return ajson_project_object(pool, p, ep, node);
+  if (*p == '[')
+    return ajson_project_array(pool, p, ep, node);
+  return NULL;
+}
+
+ajson_t *ajson_parse_projected(aml_pool_t *pool, char *p, char *ep,
+                               const char **paths, size_t num_paths) {
+  ajson_ondemand_t *root = ajson_ondemand(pool, p, ep);
+  if (!root)
+    return NULL;
+  ajson_projection_t projection;
+  memset(&projection, 0, sizeof(projection));
+  for (size_t i = 0; i < num_paths; i++)
+    ajson_projection_add(pool, &projection, paths[i]);
+  if (!num_paths)
+    projection.leaf = true;
+  return ajson_project_value(pool, root->p, root->ep, &projection);
+}
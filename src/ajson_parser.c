@@ -0,0 +1,599 @@
+/*
+Copyright 2019 Andy Curtis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "a-json-library/ajson.h"
+
+#include "a-memory-library/aml_buffer.h"
+#include "a-memory-library/aml_pool.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+/* The incremental parser follows the same grammar as ajson_parse (including
+   its leniency), but because a token may be split across chunks the state
+   is explicit instead of being the position in a goto state machine.  A
+   token which spans chunks is collected in h->token.  The tokenizer reports
+   each token as an event.  The events either build a tree (the chunks are
+   owned by the caller, so strings, keys, and numbers are copied into the
+   pool) or are passed to the ajson_sax_t callbacks as slices. */
+typedef enum {
+  AJSON_STATE_VALUE,
+  AJSON_STATE_KEY,
+  AJSON_STATE_KEY_STRING,
+  AJSON_STATE_COLON,
+  AJSON_STATE_STRING,
+  AJSON_STATE_NUMBER,
+  AJSON_STATE_LITERAL,
+  AJSON_STATE_NULL_OR_BINARY,
+  AJSON_STATE_BINARY_LENGTH,
+  AJSON_STATE_BINARY,
+  AJSON_STATE_NEXT,
+  AJSON_STATE_DONE,
+  AJSON_STATE_ERROR
+} ajson_parser_state_t;
+
+typedef enum {
+  AJSON_NUMBER_SIGN,
+  AJSON_NUMBER_ZERO,
+  AJSON_NUMBER_INTEGER,
+  AJSON_NUMBER_DOT,
+  AJSON_NUMBER_FRACTION,
+  AJSON_NUMBER_E,
+  AJSON_NUMBER_E_SIGN,
+  AJSON_NUMBER_EXPONENT
+} ajson_number_state_t;
+
+struct ajson_parser_s {
+  aml_pool_t *pool;
+  aml_buffer_t *token; /* allocated the first time a token spans chunks */
+  aml_buffer_t *stack; /* the type of each open object or array */
+  const ajson_sax_t *sax;
+  void *arg;
+  ajson_t *root;
+  ajson_t *cur; /* the innermost open object or array */
+
+  char *key;
+  uint32_t key_length;
+  uint32_t key_hash;
+
+  ajson_parser_state_t state;
+  ajson_number_state_t number_state;
+  uint32_t data_type;
+  const char *literal;    /* the complete true/false/null literal */
+  uint32_t literal_pos;   /* how much of the literal has been matched */
+  uint32_t binary_length;
+  uint32_t binary_pos;
+  bool escaped;
+
+  size_t offset;     /* bytes fed before the current chunk */
+  size_t row;
+  size_t row_offset; /* offset of the first byte in the current row */
+  ajson_t *error;
+};
+
+static void ajson_parser_setup(ajson_parser_t *h, aml_pool_t *pool,
+                               const ajson_sax_t *sax, void *arg) {
+  memset(h, 0, sizeof(*h));
+  h->pool = pool;
+  h->stack = aml_buffer_init(64);
+  h->sax = sax;
+  h->arg = arg;
+  h->state = AJSON_STATE_VALUE;
+  h->row = 1;
+}
+
+ajson_parser_t *ajson_parser_init(aml_pool_t *pool) {
+  ajson_parser_t *h =
+      (ajson_parser_t *)aml_pool_alloc(pool, sizeof(ajson_parser_t));
+  ajson_parser_setup(h, pool, NULL, NULL);
+  return h;
+}
+
+ajson_parser_t *ajson_parser_sax_init(aml_pool_t *pool, const ajson_sax_t *sax,
+                                      void *arg) {
+  ajson_parser_t *h =
+      (ajson_parser_t *)aml_pool_alloc(pool, sizeof(ajson_parser_t));
+  ajson_parser_setup(h, pool, sax, arg);
+  return h;
+}
+
+void ajson_parser_destroy(ajson_parser_t *h) {
+  if (h->token) {
+    aml_buffer_destroy(h->token);
+    h->token = NULL;
+  }
+  if (h->stack) {
+    aml_buffer_destroy(h->stack);
+    h->stack = NULL;
+  }
+}
+
+static bool ajson_parser_fail(ajson_parser_t *h, size_t offset) {
+  ajson_error_t *err =
+      (ajson_error_t *)aml_pool_zalloc(h->pool, sizeof(ajson_error_t));
+  err->type = AJSON_ERROR;
+  err->pool = h->pool;
+  err->row = h->row;
+  err->column = (offset - h->row_offset) + 1;
+  err->offset = offset;
+  h->error = (ajson_t *)err;
+  h->state = AJSON_STATE_ERROR;
+  return false;
+}
+
+/* returns the token which ends at p (and may have started in an earlier
+   chunk).  The token is valid until the next call to ajson_parser_done. */
+static const char *ajson_parser_slice(ajson_parser_t *h, const char *tp,
+                                      const char *p, uint32_t *length) {
+  if (h->token && aml_buffer_length(h->token)) {
+    if (p > tp)
+      aml_buffer_append(h->token, tp, p - tp);
+    tp = aml_buffer_data(h->token);
+    p = tp + aml_buffer_length(h->token);
+  }
+  *length = p - tp;
+  return tp;
+}
+
+static char *ajson_parser_copy(ajson_parser_t *h, const char *s,
+                               uint32_t length) {
+  char *r = (char *)aml_pool_alloc(h->pool, length + 1);
+  memcpy(r, s, length);
+  r[length] = 0;
+  return r;
+}
+
+static inline uint32_t ajson_parser_top(ajson_parser_t *h) {
+  size_t length = aml_buffer_length(h->stack);
+  return length ? (uint32_t)aml_buffer_data(h->stack)[length - 1] : 0;
+}
+
+/* called after each key or value */
+static void ajson_parser_done(ajson_parser_t *h, ajson_parser_state_t state) {
+  if (h->token)
+    aml_buffer_clear(h->token);
+  if (state == AJSON_STATE_NEXT && !aml_buffer_length(h->stack))
+    state = AJSON_STATE_DONE;
+  h->state = state;
+}
+
+/* allocate a value (or container of size bytes) and attach it to the
+   innermost open object or array */
+static ajson_t *ajson_parser_add(ajson_parser_t *h, size_t size) {
+  ajson_t *j;
+  ajson_t *cur = h->cur;
+  if (cur && cur->type == AJSON_ARRAY) {
+    _ajsona_t *arr = (_ajsona_t *)cur;
+    ajsona_t *anode =
+        (ajsona_t *)aml_pool_zalloc(h->pool, sizeof(ajsona_t) + size);
+    j = anode->value = (ajson_t *)(anode + 1);
+    j->parent = cur;
+    arr->num_entries++;
+    if (!arr->head)
+      arr->head = arr->tail = anode;
+    else {
+      anode->previous = arr->tail;
+      arr->tail->next = anode;
+      arr->tail = anode;
+    }
+  } else {
+    j = (ajson_t *)aml_pool_zalloc(h->pool, size);
+    if (cur)
+      _ajsono_append(cur, h->key, h->key_length, h->key_hash, j, false);
+    else
+      h->root = j;
+  }
+  return j;
+}
+
+static void ajson_parser_key(ajson_parser_t *h, const char *key,
+                             uint32_t length) {
+  if (h->sax) {
+    if (h->sax->key)
+      h->sax->key(h->arg, key, length);
+  } else {
+    h->key = ajson_parser_copy(h, key, length);
+    h->key_length = length;
+    h->key_hash = ajson_hash(key, length);
+  }
+  ajson_parser_done(h, AJSON_STATE_COLON);
+}
+
+/* true, false, null, and zero are static strings, everything else is a
+   slice of the input */
+static void ajson_parser_value(ajson_parser_t *h, uint32_t type,
+                               const char *value, uint32_t length) {
+  if (h->sax) {
+    if (h->sax->scalar)
+      h->sax->scalar(h->arg, (ajson_type_t)type, value, length);
+  } else {
+    ajson_t *j = ajson_parser_add(h, sizeof(ajson_t));
+    j->type = type;
+    if (type == AJSON_STRING || type == AJSON_NUMBER ||
+        type == AJSON_DECIMAL || type == AJSON_BINARY)
+      j->value = ajson_parser_copy(h, value, length);
+    else
+      j->value = (char *)value;
+    j->length = length;
+  }
+  ajson_parser_done(h, AJSON_STATE_NEXT);
+}
+
+static void ajson_parser_open(ajson_parser_t *h, uint32_t type) {
+  aml_buffer_appendc(h->stack, (char)type);
+  if (h->sax) {
+    void (*cb)(void *) =
+        type == AJSON_OBJECT ? h->sax->start_object : h->sax->start_array;
+    if (cb)
+      cb(h->arg);
+  } else if (type == AJSON_OBJECT) {
+    _ajsono_t *obj = (_ajsono_t *)ajson_parser_add(h, sizeof(_ajsono_t));
+    obj->type = AJSON_OBJECT;
+    obj->pool = h->pool;
+    h->cur = (ajson_t *)obj;
+  } else {
+    _ajsona_t *arr = (_ajsona_t *)ajson_parser_add(h, sizeof(_ajsona_t));
+    arr->type = AJSON_ARRAY;
+    arr->pool = h->pool;
+    h->cur = (ajson_t *)arr;
+  }
+  h->state = type == AJSON_OBJECT ? AJSON_STATE_KEY : AJSON_STATE_VALUE;
+}
+
+static void ajson_parser_close(ajson_parser_t *h) {
+  uint32_t type = ajson_parser_top(h);
+  aml_buffer_resize(h->stack, aml_buffer_length(h->stack) - 1);
+  if (h->sax) {
+    void (*cb)(void *) =
+        type == AJSON_OBJECT ? h->sax->end_object : h->sax->end_array;
+    if (cb)
+      cb(h->arg);
+  } else
+    h->cur = h->cur->parent;
+  ajson_parser_done(h, AJSON_STATE_NEXT);
+}
+
+static bool ajson_parser_number(ajson_parser_t *h, const char *tp,
+                                const char *p) {
+  uint32_t length;
+  switch (h->number_state) {
+  case AJSON_NUMBER_ZERO:
+    ajson_parser_value(h, AJSON_ZERO, "0", 1);
+    return true;
+  case AJSON_NUMBER_INTEGER:
+  case AJSON_NUMBER_FRACTION:
+  case AJSON_NUMBER_EXPONENT: {
+    const char *value = ajson_parser_slice(h, tp, p, &length);
+    ajson_parser_value(h, h->data_type, value, length);
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
+bool ajson_parser_feed(ajson_parser_t *h, const char *p, size_t length) {
+  const char *sp = p;
+  const char *ep = p + length;
+  const char *tp = p; /* start of the current token within this chunk */
+  const char *value;
+  uint32_t len;
+  char ch;
+  while (p < ep) {
+    switch (h->state) {
+    case AJSON_STATE_VALUE:
+      ch = *p++;
+      switch (ch) {
+      case '\n':
+        h->row++;
+        h->row_offset = h->offset + (p - sp);
+        break;
+      case 32:
+      case 9:
+      case 13:
+        break;
+      case '\"':
+        tp = p;
+        h->escaped = false;
+        h->state = AJSON_STATE_STRING;
+        break;
+      case '{':
+        ajson_parser_open(h, AJSON_OBJECT);
+        break;
+      case '[':
+        ajson_parser_open(h, AJSON_ARRAY);
+        break;
+      case ']':
+        if (ajson_parser_top(h) != AJSON_ARRAY)
+          return ajson_parser_fail(h, h->offset + (p - sp) - 1);
+        ajson_parser_close(h);
+        break;
+      case '-':
+        tp = p - 1;
+        h->data_type = AJSON_NUMBER;
+        h->number_state = AJSON_NUMBER_SIGN;
+        h->state = AJSON_STATE_NUMBER;
+        break;
+      case '0':
+        tp = p - 1;
+        h->data_type = AJSON_NUMBER;
+        h->number_state = AJSON_NUMBER_ZERO;
+        h->state = AJSON_STATE_NUMBER;
+        break;
+      case '1':
+      case '2':
+      case '3':
+      case '4':
+      case '5':
+      case '6':
+      case '7':
+      case '8':
+      case '9':
+        tp = p - 1;
+        h->data_type = AJSON_NUMBER;
+        h->number_state = AJSON_NUMBER_INTEGER;
+        h->state = AJSON_STATE_NUMBER;
+        break;
+      case 't':
+        h->literal = "true";
+        h->literal_pos = 1;
+        h->data_type = AJSON_TRUE;
+        h->state = AJSON_STATE_LITERAL;
+        break;
+      case 'f':
+        h->literal = "false";
+        h->literal_pos = 1;
+        h->data_type = AJSON_FALSE;
+        h->state = AJSON_STATE_LITERAL;
+        break;
+      case 'n':
+        h->state = AJSON_STATE_NULL_OR_BINARY;
+        break;
+      default:
+        return ajson_parser_fail(h, h->offset + (p - sp) - 1);
+      }
+      break;
+    case AJSON_STATE_KEY:
+      ch = *p++;
+      switch (ch) {
+      case '\n':
+        h->row++;
+        h->row_offset = h->offset + (p - sp);
+        break;
+      case 32:
+      case 9:
+      case 13:
+        break;
+      case '\"':
+        tp = p;
+        h->escaped = false;
+        h->state = AJSON_STATE_KEY_STRING;
+        break;
+      case '}':
+        ajson_parser_close(h);
+        break;
+      default:
+        return ajson_parser_fail(h, h->offset + (p - sp) - 1);
+      }
+      break;
+    case AJSON_STATE_KEY_STRING:
+    case AJSON_STATE_STRING:
+      while (p < ep) {
+        ch = *p;
+        if (h->escaped)
+          h->escaped = false;
+        else if (ch == '\\')
+          h->escaped = true;
+        else if (ch == '\"')
+          break;
+        p++;
+      }
+      if (p == ep)
+        break;
+      value = ajson_parser_slice(h, tp, p, &len);
+      if (h->state == AJSON_STATE_KEY_STRING)
+        ajson_parser_key(h, value, len);
+      else
+        ajson_parser_value(h, AJSON_STRING, value, len);
+      p++;
+      break;
+    case AJSON_STATE_COLON:
+      while (p < ep && *p != ':')
+        p++;
+      if (p < ep) {
+        p++;
+        h->state = AJSON_STATE_VALUE;
+      }
+      break;
+    case AJSON_STATE_NUMBER:
+      while (p < ep) {
+        ch = *p;
+        switch (h->number_state) {
+        case AJSON_NUMBER_SIGN:
+          if (ch == '0')
+            h->number_state = AJSON_NUMBER_ZERO;
+          else if (ch >= '1' && ch <= '9')
+            h->number_state = AJSON_NUMBER_INTEGER;
+          else
+            return ajson_parser_fail(h, h->offset + (p - sp));
+          break;
+        case AJSON_NUMBER_ZERO:
+          if (ch != '.')
+            goto end_of_number;
+          h->data_type = AJSON_DECIMAL;
+          h->number_state = AJSON_NUMBER_DOT;
+          break;
+        case AJSON_NUMBER_INTEGER:
+          if (ch == '.') {
+            h->data_type = AJSON_DECIMAL;
+            h->number_state = AJSON_NUMBER_DOT;
+          } else if (ch == 'e' || ch == 'E')
+            h->number_state = AJSON_NUMBER_E;
+          else if (ch < '0' || ch > '9')
+            goto end_of_number;
+          break;
+        case AJSON_NUMBER_DOT:
+          if (ch < '0' || ch > '9')
+            return ajson_parser_fail(h, h->offset + (p - sp));
+          h->number_state = AJSON_NUMBER_FRACTION;
+          break;
+        case AJSON_NUMBER_FRACTION:
+          if (ch == 'e' || ch == 'E')
+            h->number_state = AJSON_NUMBER_E;
+          else if (ch < '0' || ch > '9')
+            goto end_of_number;
+          break;
+        case AJSON_NUMBER_E:
+          if (ch == '+' || ch == '-')
+            h->number_state = AJSON_NUMBER_E_SIGN;
+          else if (ch >= '0' && ch <= '9')
+            h->number_state = AJSON_NUMBER_EXPONENT;
+          else
+            return ajson_parser_fail(h, h->offset + (p - sp));
+          break;
+        case AJSON_NUMBER_E_SIGN:
+          if (ch < '0' || ch > '9')
+            return ajson_parser_fail(h, h->offset + (p - sp));
+          h->number_state = AJSON_NUMBER_EXPONENT;
+          break;
+        case AJSON_NUMBER_EXPONENT:
+          if (ch < '0' || ch > '9')
+            goto end_of_number;
+          break;
+        }
+        p++;
+      }
+      break;
+    end_of_number:
+      ajson_parser_number(h, tp, p);
+      break;
+    case AJSON_STATE_LITERAL:
+      while (p < ep && h->literal[h->literal_pos]) {
+        if (*p != h->literal[h->literal_pos])
+          return ajson_parser_fail(h, h->offset + (p - sp));
+        p++;
+        h->literal_pos++;
+      }
+      if (!h->literal[h->literal_pos])
+        ajson_parser_value(h, h->data_type, h->literal, h->literal_pos);
+      break;
+    case AJSON_STATE_NULL_OR_BINARY:
+      ch = *p++;
+      if (ch == 'u') {
+        h->literal = "null";
+        h->literal_pos = 2;
+        h->data_type = AJSON_NULL;
+        h->state = AJSON_STATE_LITERAL;
+      } else if (ch == 'b') {
+        h->binary_pos = 0;
+        h->binary_length = 0;
+        h->state = AJSON_STATE_BINARY_LENGTH;
+      } else
+        return ajson_parser_fail(h, h->offset + (p - sp) - 1);
+      break;
+    case AJSON_STATE_BINARY_LENGTH:
+      /* the length is a native uint32_t, see ajson_dump_to_buffer */
+      while (p < ep && h->binary_pos < sizeof(uint32_t))
+        ((char *)&h->binary_length)[h->binary_pos++] = *p++;
+      if (h->binary_pos == sizeof(uint32_t)) {
+        h->binary_pos = 0;
+        tp = p;
+        h->state = AJSON_STATE_BINARY;
+      }
+      break;
+    case AJSON_STATE_BINARY:
+      if ((size_t)(ep - p) < h->binary_length - h->binary_pos) {
+        h->binary_pos += ep - p;
+        p = ep;
+        break;
+      }
+      p += h->binary_length - h->binary_pos;
+      value = ajson_parser_slice(h, tp, p, &len);
+      ajson_parser_value(h, AJSON_BINARY, value, len);
+      break;
+    case AJSON_STATE_NEXT:
+      ch = *p++;
+      switch (ch) {
+      case '\n':
+        h->row++;
+        h->row_offset = h->offset + (p - sp);
+        break;
+      case 32:
+      case 9:
+      case 13:
+        break;
+      case ',':
+        h->state = ajson_parser_top(h) == AJSON_OBJECT ? AJSON_STATE_KEY
+                                                       : AJSON_STATE_VALUE;
+        break;
+      case '}':
+        if (ajson_parser_top(h) != AJSON_OBJECT)
+          return ajson_parser_fail(h, h->offset + (p - sp) - 1);
+        ajson_parser_close(h);
+        break;
+      case ']':
+        if (ajson_parser_top(h) != AJSON_ARRAY)
+          return ajson_parser_fail(h, h->offset + (p - sp) - 1);
+        ajson_parser_close(h);
+        break;
+      default:
+        return ajson_parser_fail(h, h->offset + (p - sp) - 1);
+      }
+      break;
+    case AJSON_STATE_DONE:
+      p = ep;
+      break;
+    case AJSON_STATE_ERROR:
+      return false;
+    }
+  }
+  switch (h->state) {
+  case AJSON_STATE_KEY_STRING:
+  case AJSON_STATE_STRING:
+  case AJSON_STATE_NUMBER:
+  case AJSON_STATE_BINARY:
+    if (!h->token)
+      h->token = aml_buffer_init(256);
+    aml_buffer_append(h->token, tp, ep - tp);
+    break;
+  default:
+    break;
+  }
+  h->offset += length;
+  return true;
+}
+
+ajson_t *ajson_parser_finish(ajson_parser_t *h) {
+  if (h->state == AJSON_STATE_NUMBER && !ajson_parser_top(h)) {
+    if (!ajson_parser_number(h, NULL, NULL))
+      ajson_parser_fail(h, h->offset);
+  }
+  if (h->state == AJSON_STATE_DONE)
+    return h->sax ? NULL : h->root;
+  if (h->state != AJSON_STATE_ERROR)
+    ajson_parser_fail(h, h->offset);
+  return h->error;
+}
+
+ajson_t *ajson_sax_parse(aml_pool_t *pool, const char *p, const char *ep,
+                         const ajson_sax_t *sax, void *arg) {
+  ajson_parser_t h;
+  ajson_parser_setup(&h, pool, sax, arg);
+  ajson_parser_feed(&h, p, ep - p);
+  ajson_t *res = ajson_parser_finish(&h);
+  ajson_parser_destroy(&h);
+  return res;
+}
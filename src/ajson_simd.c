@@ -0,0 +1,105 @@
+/*
+Copyright 2019 Andy Curtis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "ajson_simd.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+_Atomic(const ajson_simd_kernels_t *) _ajson_simd = NULL;
+
+static ajson_simd_kernels_t ajson_simd_tables[AJSON_SIMD_NEON + 1];
+static pthread_once_t ajson_simd_once = PTHREAD_ONCE_INIT;
+
+static ajson_simd_t ajson_simd_supported(void) {
+#if defined(AJSON_SIMD_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+    return AJSON_SIMD_AVX512;
+  if (__builtin_cpu_supports("avx2"))
+    return AJSON_SIMD_AVX2;
+  if (__builtin_cpu_supports("sse4.2"))
+    return AJSON_SIMD_SSE42;
+  return AJSON_SIMD_SCALAR;
+#elif defined(AJSON_SIMD_NEON)
+  return AJSON_SIMD_NEON;
+#else
+  return AJSON_SIMD_SCALAR;
+#endif
+}
+
+static ajson_simd_t ajson_simd_from_env(ajson_simd_t level) {
+  const char *s = getenv("AJSON_SIMD");
+  if (!s || !*s)
+    return level;
+  if (!strcasecmp(s, "scalar"))
+    return AJSON_SIMD_SCALAR;
+  if (!strcasecmp(s, "sse4.2") || !strcasecmp(s, "sse42"))
+    return AJSON_SIMD_SSE42;
+  if (!strcasecmp(s, "avx2"))
+    return AJSON_SIMD_AVX2;
+  if (!strcasecmp(s, "avx512"))
+    return AJSON_SIMD_AVX512;
+  if (!strcasecmp(s, "neon"))
+    return AJSON_SIMD_NEON;
+  return level;
+}
+
+/* the table built for level (whose kernels are those of the best level the
+   cpu supports up to it) */
+static const ajson_simd_kernels_t *ajson_simd_table(ajson_simd_t level) {
+  if ((unsigned)level > AJSON_SIMD_NEON)
+    level = AJSON_SIMD_AVX512;
+  return &ajson_simd_tables[level];
+}
+
+static void ajson_simd_build(void) {
+  ajson_simd_t supported = ajson_simd_supported();
+  for (int i = AJSON_SIMD_SCALAR; i <= AJSON_SIMD_NEON; i++) {
+    ajson_simd_t level = (ajson_simd_t)i;
+    if (supported == AJSON_SIMD_NEON)
+      level = level == AJSON_SIMD_SCALAR ? AJSON_SIMD_SCALAR : AJSON_SIMD_NEON;
+    else if (level == AJSON_SIMD_NEON || level > supported)
+      level = supported;
+
+    ajson_simd_kernels_t *k = &ajson_simd_tables[i];
+    k->level = level;
+    _ajson_index_select(k, level);
+    _ajson_escape_select(k, level);
+    _ajson_utf8_select(k, level);
+  }
+  atomic_store_explicit(
+      &_ajson_simd, ajson_simd_table(ajson_simd_from_env(AJSON_SIMD_AVX512)),
+      memory_order_release);
+}
+
+const ajson_simd_kernels_t *_ajson_simd_init(void) {
+  pthread_once(&ajson_simd_once, ajson_simd_build);
+  return atomic_load_explicit(&_ajson_simd, memory_order_acquire);
+}
+
+ajson_simd_t ajson_simd_level(void) {
+  return _ajson_simd_kernels()->level;
+}
+
+ajson_simd_t ajson_set_simd_level(ajson_simd_t level) {
+  _ajson_simd_init();
+  const ajson_simd_kernels_t *k = ajson_simd_table(level);
+  atomic_store_explicit(&_ajson_simd, k, memory_order_release);
+  return k->level;
+}
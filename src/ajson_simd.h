@@ -0,0 +1,66 @@
+/*
+Copyright 2019 Andy Curtis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _ajson_simd_H
+#define _ajson_simd_H
+
+#include "a-json-library/ajson.h"
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AJSON_SIMD_X86
+#include <immintrin.h>
+#define AJSON_TARGET(x) __attribute__((target(x)))
+#elif defined(__ARM_NEON)
+#define AJSON_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+/* The vectorized kernels used by the library.  Each module fills in its own
+   entries for the selected level (see _ajson_index_select). */
+typedef struct {
+  ajson_simd_t level;
+  void (*index_masks)(const char *s, uint64_t *quotes, uint64_t *backslashes,
+                      uint64_t *spaces);
+  uint64_t (*escape_mask)(const char *s);
+  uint64_t (*backslash_mask)(const char *s);
+  bool (*utf8_valid)(const char *s, size_t length);
+} ajson_simd_kernels_t;
+
+/* A table is built for every level once (with pthread_once) and never
+   changes afterwards.  The current one is published through an atomic
+   pointer, so threads which start parsing at the same time (or while the
+   level is changed) always see a complete table. */
+extern _Atomic(const ajson_simd_kernels_t *) _ajson_simd;
+
+const ajson_simd_kernels_t *_ajson_simd_init(void);
+
+static inline const ajson_simd_kernels_t *_ajson_simd_kernels(void) {
+  const ajson_simd_kernels_t *k =
+      atomic_load_explicit(&_ajson_simd, memory_order_acquire);
+  if (!k)
+    k = _ajson_simd_init();
+  return k;
+}
+
+void _ajson_index_select(ajson_simd_kernels_t *k, ajson_simd_t level);
+void _ajson_escape_select(ajson_simd_kernels_t *k, ajson_simd_t level);
+void _ajson_utf8_select(ajson_simd_kernels_t *k, ajson_simd_t level);
+
+#endif
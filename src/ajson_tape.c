@@ -0,0 +1,356 @@
+/*
+Copyright 2019 Andy Curtis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "a-json-library/ajson.h"
+
+#include "a-memory-library/aml_buffer.h"
+#include "a-memory-library/aml_pool.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/* The tape is written by the events of the incremental parser's tokenizer,
+   so no tree is built.  The start word of a container is written when it is
+   opened and its payload (the index of the end word) is filled in when it
+   is closed. */
+typedef struct {
+  size_t index;
+  size_t count;
+  bool object;
+} ajson_tape_open_t;
+
+typedef struct {
+  aml_buffer_t *words;
+  aml_buffer_t *strings;
+  aml_buffer_t *stack;
+} ajson_tape_builder_t;
+
+static inline void ajson_tape_word(ajson_tape_builder_t *b, uint32_t tag,
+                                   uint64_t payload) {
+  uint64_t w = ((uint64_t)tag << AJSON_TAPE_TAG_SHIFT) | payload;
+  aml_buffer_append(b->words, &w, sizeof(w));
+}
+
+static inline size_t ajson_tape_string(ajson_tape_builder_t *b,
+                                       const char *s, size_t length) {
+  size_t offset = aml_buffer_length(b->strings);
+  uint32_t len = length;
+  char *d = (char *)aml_buffer_append_alloc(b->strings,
+                                            sizeof(len) + length + 1);
+  memcpy(d, &len, sizeof(len));
+  if (length)
+    memcpy(d + sizeof(len), s, length);
+  d[sizeof(len) + length] = 0;
+  return offset;
+}
+
+/* arrays count their values, objects count their keys */
+static inline void ajson_tape_element(ajson_tape_builder_t *b) {
+  size_t depth = aml_buffer_length(b->stack) / sizeof(ajson_tape_open_t);
+  if (!depth)
+    return;
+  ajson_tape_open_t *top =
+      (ajson_tape_open_t *)aml_buffer_data(b->stack) + depth - 1;
+  if (!top->object)
+    top->count++;
+}
+
+static void ajson_tape_open(ajson_tape_builder_t *b, bool object) {
+  ajson_tape_element(b);
+  ajson_tape_open_t o;
+  o.index = aml_buffer_length(b->words) / sizeof(uint64_t);
+  o.count = 0;
+  o.object = object;
+  aml_buffer_append(b->stack, &o, sizeof(o));
+  ajson_tape_word(b, object ? AJSON_OBJECT : AJSON_ARRAY, 0);
+}
+
+static void ajson_tape_close(ajson_tape_builder_t *b) {
+  size_t length = aml_buffer_length(b->stack) - sizeof(ajson_tape_open_t);
+  ajson_tape_open_t *o =
+      (ajson_tape_open_t *)(aml_buffer_data(b->stack) + length);
+  size_t end = aml_buffer_length(b->words) / sizeof(uint64_t);
+  ajson_tape_word(b, o->object ? AJSON_TAPE_END_OBJECT : AJSON_TAPE_END_ARRAY,
+                  o->count);
+  uint64_t *start = (uint64_t *)aml_buffer_data(b->words) + o->index;
+  *start |= end;
+  aml_buffer_resize(b->stack, length);
+}
+
+static void ajson_tape_start_object(void *arg) {
+  ajson_tape_open((ajson_tape_builder_t *)arg, true);
+}
+
+static void ajson_tape_start_array(void *arg) {
+  ajson_tape_open((ajson_tape_builder_t *)arg, false);
+}
+
+static void ajson_tape_end(void *arg) {
+  ajson_tape_close((ajson_tape_builder_t *)arg);
+}
+
+static void ajson_tape_key(void *arg, const char *key, size_t length) {
+  ajson_tape_builder_t *b = (ajson_tape_builder_t *)arg;
+  size_t depth = aml_buffer_length(b->stack) / sizeof(ajson_tape_open_t);
+  ((ajson_tape_open_t *)aml_buffer_data(b->stack))[depth - 1].count++;
+  ajson_tape_word(b, AJSON_STRING, ajson_tape_string(b, key, length));
+}
+
+static void ajson_tape_scalar(void *arg, ajson_type_t type, const char *value,
+                              size_t length) {
+  ajson_tape_builder_t *b = (ajson_tape_builder_t *)arg;
+  ajson_tape_element(b);
+  if (type == AJSON_NULL || type == AJSON_FALSE || type == AJSON_TRUE)
+    ajson_tape_word(b, type, 0);
+  else
+    ajson_tape_word(b, type, ajson_tape_string(b, value, length));
+}
+
+static const ajson_sax_t ajson_tape_sax = {
+    ajson_tape_start_object, ajson_tape_end,    ajson_tape_start_array,
+    ajson_tape_end,          ajson_tape_key,    ajson_tape_scalar};
+
+/* the words and the strings are placed after the header in one allocation */
+static ajson_tape_t *ajson_tape_alloc(aml_pool_t *pool, size_t num_words,
+                                      size_t strings_length) {
+  size_t size = sizeof(ajson_tape_t) + (num_words * sizeof(uint64_t)) +
+                strings_length;
+  ajson_tape_t *t = (ajson_tape_t *)aml_pool_alloc(pool, size);
+  t->words = (uint64_t *)(t + 1);
+  t->num_words = num_words;
+  t->strings = (char *)(t->words + num_words);
+  t->strings_length = strings_length;
+  return t;
+}
+
+ajson_tape_t *ajson_tape_parse(aml_pool_t *pool, const char *p,
+                               const char *ep) {
+  ajson_tape_builder_t b;
+  /* a word per value is a reasonable guess at the number of words */
+  b.words = aml_buffer_init(((ep - p) / 4) + 64);
+  b.strings = aml_buffer_init((ep - p) + 64);
+  b.stack = aml_buffer_init(sizeof(ajson_tape_open_t) * 32);
+
+  ajson_tape_t *t = NULL;
+  if (!ajson_sax_parse(pool, p, ep, &ajson_tape_sax, &b)) {
+    size_t num_words = aml_buffer_length(b.words) / sizeof(uint64_t);
+    size_t strings_length = aml_buffer_length(b.strings);
+    t = ajson_tape_alloc(pool, num_words, strings_length);
+    memcpy(t->words, aml_buffer_data(b.words), num_words * sizeof(uint64_t));
+    memcpy(t->strings, aml_buffer_data(b.strings), strings_length);
+  }
+  aml_buffer_destroy(b.stack);
+  aml_buffer_destroy(b.strings);
+  aml_buffer_destroy(b.words);
+  return t;
+}
+
+/* The tape only contains offsets, so it is written as is after a small
+   header.  The words are in the byte order of the machine. */
+static const char ajson_tape_magic[8] = {'a', 'j', 's', 'o',
+                                         'n', 't', 'p', '1'};
+
+bool ajson_tape_save(FILE *out, const ajson_tape_t *t) {
+  uint64_t header[2];
+  header[0] = t->num_words;
+  header[1] = t->strings_length;
+  return fwrite(ajson_tape_magic, sizeof(ajson_tape_magic), 1, out) == 1 &&
+         fwrite(header, sizeof(header), 1, out) == 1 &&
+         fwrite(t->words, sizeof(uint64_t), t->num_words, out) ==
+             t->num_words &&
+         fwrite(t->strings, 1, t->strings_length, out) == t->strings_length;
+}
+
+/* the number of bytes left to read in, or -1 if it is not a regular file */
+static int64_t ajson_tape_remaining(FILE *in) {
+  struct stat st;
+  off_t pos = ftello(in);
+  if (pos < 0 || fstat(fileno(in), &st) || !S_ISREG(st.st_mode))
+    return -1;
+  return st.st_size > pos ? st.st_size - pos : 0;
+}
+
+/* a string, number, or binary value is a length, the text, and a zero, all
+   within the arena */
+static bool ajson_tape_check_string(const ajson_tape_t *t, size_t offset) {
+  uint32_t len;
+  if (offset > t->strings_length ||
+      t->strings_length - offset < sizeof(len) + 1)
+    return false;
+  memcpy(&len, t->strings + offset, sizeof(len));
+  if (t->strings_length - offset - sizeof(len) - 1 < len)
+    return false;
+  return t->strings[offset + sizeof(len) + len] == 0;
+}
+
+/* The tape is walked once.  Each container must end (with the matching end
+   word) after it starts and before the container it is in ends, its end
+   word must hold the number of values (or members) found directly in it,
+   the values of an object must alternate between a string key and a value,
+   and there must be exactly one root value. */
+static bool ajson_tape_check(const ajson_tape_t *t) {
+  aml_buffer_t *stack = aml_buffer_init(sizeof(ajson_tape_open_t) * 32);
+  bool ok = true;
+  for (size_t i = 0; ok && i < t->num_words; i++) {
+    size_t depth = aml_buffer_length(stack) / sizeof(ajson_tape_open_t);
+    ajson_tape_open_t *top =
+        depth ? (ajson_tape_open_t *)aml_buffer_data(stack) + depth - 1 : NULL;
+    uint32_t tag = _ajson_tape_tag(t, i);
+    size_t payload = _ajson_tape_payload(t, i);
+    if (top && i == top->index) {
+      /* the end word of the innermost container (its tag was checked when
+         the container started) */
+      if (top->object)
+        ok = !(top->count & 1) && payload == top->count / 2;
+      else
+        ok = payload == top->count;
+      aml_buffer_resize(stack, (depth - 1) * sizeof(ajson_tape_open_t));
+    } else {
+      if (top) {
+        if (top->object && !(top->count & 1) && tag != AJSON_STRING)
+          ok = false;
+        top->count++;
+      }
+      if (tag == AJSON_OBJECT || tag == AJSON_ARRAY) {
+        uint32_t end_tag =
+            tag == AJSON_OBJECT ? AJSON_TAPE_END_OBJECT : AJSON_TAPE_END_ARRAY;
+        if (payload <= i || payload >= t->num_words ||
+            (top && payload >= top->index) ||
+            _ajson_tape_tag(t, payload) != end_tag)
+          ok = false;
+        else {
+          ajson_tape_open_t o; /* index is the end word here */
+          o.index = payload;
+          o.count = 0;
+          o.object = tag == AJSON_OBJECT;
+          aml_buffer_append(stack, &o, sizeof(o));
+        }
+      } else if (tag == AJSON_BINARY || tag == AJSON_STRING ||
+                 (tag >= AJSON_ZERO && tag <= AJSON_DECIMAL))
+        ok = ok && ajson_tape_check_string(t, payload);
+      else if (tag != AJSON_NULL && tag != AJSON_FALSE && tag != AJSON_TRUE)
+        ok = false;
+    }
+    if (ok && !aml_buffer_length(stack) && i + 1 != t->num_words)
+      ok = false;
+  }
+  aml_buffer_destroy(stack);
+  return ok;
+}
+
+ajson_tape_t *ajson_tape_load(aml_pool_t *pool, FILE *in) {
+  char magic[sizeof(ajson_tape_magic)];
+  uint64_t header[2];
+  if (fread(magic, sizeof(magic), 1, in) != 1 ||
+      memcmp(magic, ajson_tape_magic, sizeof(magic)) ||
+      fread(header, sizeof(header), 1, in) != 1 || !header[0])
+    return NULL;
+
+  /* the indexes and offsets must fit in a payload, the tape in memory, and
+     (when the size is known) the tape in the rest of the file */
+  uint64_t max_size = SIZE_MAX - sizeof(ajson_tape_t);
+  if (header[0] > AJSON_TAPE_PAYLOAD_MASK ||
+      header[1] > AJSON_TAPE_PAYLOAD_MASK ||
+      header[0] > max_size / sizeof(uint64_t) ||
+      header[1] > max_size - (header[0] * sizeof(uint64_t)))
+    return NULL;
+  size_t size = (header[0] * sizeof(uint64_t)) + header[1];
+  int64_t remaining = ajson_tape_remaining(in);
+  if (remaining >= 0 && (uint64_t)remaining < size)
+    return NULL;
+
+  ajson_tape_t *t = NULL;
+  if (remaining >= 0) {
+    t = ajson_tape_alloc(pool, header[0], header[1]);
+    if (fread(t->words, 1, size, in) != size)
+      return NULL;
+  } else {
+    /* a pipe is read in blocks, so a bad header fails at the end of the
+       input instead of allocating whatever it claims */
+    aml_buffer_t *bh = aml_buffer_init(65536);
+    size_t length = 0;
+    while (length < size) {
+      size_t n = size - length < 1048576 ? size - length : 1048576;
+      char *d = (char *)aml_buffer_append_alloc(bh, n);
+      if (fread(d, 1, n, in) != n)
+        break;
+      length += n;
+    }
+    if (length == size) {
+      t = ajson_tape_alloc(pool, header[0], header[1]);
+      memcpy(t->words, aml_buffer_data(bh), size);
+    }
+    aml_buffer_destroy(bh);
+  }
+  if (!t || !ajson_tape_check(t))
+    return NULL;
+  return t;
+}
+
+static size_t ajson_tape_dump_value(aml_buffer_t *bh, const ajson_tape_t *t,
+                                    size_t i);
+
+static size_t ajson_tape_dump_container(aml_buffer_t *bh,
+                                        const ajson_tape_t *t, size_t i,
+                                        bool object) {
+  aml_buffer_appendc(bh, object ? '{' : '[');
+  size_t end = _ajson_tape_payload(t, i);
+  i++;
+  while (i < end) {
+    if (object) {
+      size_t length;
+      const char *key = ajson_tape_value(t, i, &length);
+      aml_buffer_appendc(bh, '\"');
+      aml_buffer_append(bh, key, length);
+      aml_buffer_append(bh, "\":", 2);
+      i++;
+    }
+    i = ajson_tape_dump_value(bh, t, i);
+    if (i < end)
+      aml_buffer_appendc(bh, ',');
+  }
+  aml_buffer_appendc(bh, object ? '}' : ']');
+  return end + 1;
+}
+
+static size_t ajson_tape_dump_value(aml_buffer_t *bh, const ajson_tape_t *t,
+                                    size_t i) {
+  uint32_t tag = _ajson_tape_tag(t, i);
+  if (tag == AJSON_OBJECT || tag == AJSON_ARRAY)
+    return ajson_tape_dump_container(bh, t, i, tag == AJSON_OBJECT);
+  size_t length;
+  const char *value = ajson_tape_value(t, i, &length);
+  if (tag == AJSON_STRING) {
+    aml_buffer_appendc(bh, '\"');
+    aml_buffer_append(bh, value, length);
+    aml_buffer_appendc(bh, '\"');
+  } else if (tag == AJSON_BINARY) {
+    aml_buffer_append(bh, "nb", 2);
+    uint32_t len = length;
+    aml_buffer_append(bh, &len, sizeof(len));
+    aml_buffer_append(bh, value, length);
+  } else
+    aml_buffer_append(bh, value, length);
+  return i + 1;
+}
+
+void ajson_tape_dump_to_buffer(aml_buffer_t *bh, const ajson_tape_t *t,
+                               size_t i) {
+  if (i < t->num_words)
+    ajson_tape_dump_value(bh, t, i);
+}
@@ -0,0 +1,333 @@
+/*
+Copyright 2019 Andy Curtis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "ajson_simd.h"
+#include "ajson_utf8.h"
+
+#include <string.h>
+
+/* Returns the offset of the first invalid sequence (RFC 3629: no overlong
+   forms, no surrogates, nothing above U+10FFFF) or length if s is valid.
+   ASCII is skipped 8 bytes at a time. */
+static size_t ajson_utf8_scalar(const unsigned char *s, size_t length) {
+  size_t i = 0;
+  while (i < length) {
+    if (i + 8 <= length) {
+      uint64_t v;
+      memcpy(&v, s + i, sizeof(v));
+      if (!(v & 0x8080808080808080ULL)) {
+        i += 8;
+        continue;
+      }
+    }
+    unsigned int c = s[i];
+    if (c < 0x80) {
+      i++;
+      continue;
+    }
+    size_t len;
+    unsigned int lo = 0x80, hi = 0xBF;
+    if (c >= 0xC2 && c <= 0xDF)
+      len = 2;
+    else if (c >= 0xE0 && c <= 0xEF) {
+      len = 3;
+      if (c == 0xE0)
+        lo = 0xA0;
+      else if (c == 0xED)
+        hi = 0x9F;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+      len = 4;
+      if (c == 0xF0)
+        lo = 0x90;
+      else if (c == 0xF4)
+        hi = 0x8F;
+    } else
+      return i;
+    if (i + len > length || s[i + 1] < lo || s[i + 1] > hi)
+      return i;
+    for (size_t k = 2; k < len; k++)
+      if ((s[i + k] & 0xC0) != 0x80)
+        return i;
+    i += len;
+  }
+  return length;
+}
+
+static bool ajson_utf8_valid_scalar(const char *s, size_t length) {
+  return ajson_utf8_scalar((const unsigned char *)s, length) == length;
+}
+
+/* The vectorized kernels use the lookup algorithm of Keiser and Lemire
+   ("Validating UTF-8 in less than one instruction per byte").  Each byte is
+   paired with the byte before it, and three 16-entry tables (indexed by the
+   high nibble of the previous byte, its low nibble, and the high nibble of
+   the current byte) give the set of errors each nibble allows.  Their AND
+   is non-zero only for an invalid pair.  Third and fourth bytes of longer
+   sequences are checked separately with saturating subtraction.  Blocks
+   which are all ASCII (and follow a block which was) are skipped, and a
+   final block of zeros catches a sequence cut off at the end. */
+#define AJSON_UTF8_TOO_SHORT (1 << 0)
+#define AJSON_UTF8_TOO_LONG (1 << 1)
+#define AJSON_UTF8_OVERLONG_3 (1 << 2)
+#define AJSON_UTF8_TOO_LARGE (1 << 3)
+#define AJSON_UTF8_SURROGATE (1 << 4)
+#define AJSON_UTF8_OVERLONG_2 (1 << 5)
+#define AJSON_UTF8_TOO_LARGE_1000 (1 << 6)
+#define AJSON_UTF8_OVERLONG_4 (1 << 6)
+#define AJSON_UTF8_TWO_CONTS (1 << 7)
+#define AJSON_UTF8_CARRY                                                       \
+  (AJSON_UTF8_TOO_SHORT | AJSON_UTF8_TOO_LONG | AJSON_UTF8_TWO_CONTS)
+
+static const uint8_t ajson_utf8_byte_1_high[16] = {
+    AJSON_UTF8_TOO_LONG,
+    AJSON_UTF8_TOO_LONG,
+    AJSON_UTF8_TOO_LONG,
+    AJSON_UTF8_TOO_LONG,
+    AJSON_UTF8_TOO_LONG,
+    AJSON_UTF8_TOO_LONG,
+    AJSON_UTF8_TOO_LONG,
+    AJSON_UTF8_TOO_LONG,
+    AJSON_UTF8_TWO_CONTS,
+    AJSON_UTF8_TWO_CONTS,
+    AJSON_UTF8_TWO_CONTS,
+    AJSON_UTF8_TWO_CONTS,
+    AJSON_UTF8_TOO_SHORT | AJSON_UTF8_OVERLONG_2,
+    AJSON_UTF8_TOO_SHORT,
+    AJSON_UTF8_TOO_SHORT | AJSON_UTF8_OVERLONG_3 | AJSON_UTF8_SURROGATE,
+    AJSON_UTF8_TOO_SHORT | AJSON_UTF8_TOO_LARGE | AJSON_UTF8_TOO_LARGE_1000 |
+        AJSON_UTF8_OVERLONG_4};
+
+static const uint8_t ajson_utf8_byte_1_low[16] = {
+    AJSON_UTF8_CARRY | AJSON_UTF8_OVERLONG_3 | AJSON_UTF8_OVERLONG_2 |
+        AJSON_UTF8_OVERLONG_4,
+    AJSON_UTF8_CARRY | AJSON_UTF8_OVERLONG_2,
+    AJSON_UTF8_CARRY,
+    AJSON_UTF8_CARRY,
+    AJSON_UTF8_CARRY | AJSON_UTF8_TOO_LARGE,
+    AJSON_UTF8_CARRY | AJSON_UTF8_TOO_LARGE | AJSON_UTF8_TOO_LARGE_1000,
+    AJSON_UTF8_CARRY | AJSON_UTF8_TOO_LARGE | AJSON_UTF8_TOO_LARGE_1000,
+    AJSON_UTF8_CARRY | AJSON_UTF8_TOO_LARGE | AJSON_UTF8_TOO_LARGE_1000,
+    AJSON_UTF8_CARRY | AJSON_UTF8_TOO_LARGE | AJSON_UTF8_TOO_LARGE_1000,
+    AJSON_UTF8_CARRY | AJSON_UTF8_TOO_LARGE | AJSON_UTF8_TOO_LARGE_1000,
+    AJSON_UTF8_CARRY | AJSON_UTF8_TOO_LARGE | AJSON_UTF8_TOO_LARGE_1000,
+    AJSON_UTF8_CARRY | AJSON_UTF8_TOO_LARGE | AJSON_UTF8_TOO_LARGE_1000,
+    AJSON_UTF8_CARRY | AJSON_UTF8_TOO_LARGE | AJSON_UTF8_TOO_LARGE_1000,
+    AJSON_UTF8_CARRY | AJSON_UTF8_TOO_LARGE | AJSON_UTF8_TOO_LARGE_1000 |
+        AJSON_UTF8_SURROGATE,
+    AJSON_UTF8_CARRY | AJSON_UTF8_TOO_LARGE | AJSON_UTF8_TOO_LARGE_1000,
+    AJSON_UTF8_CARRY | AJSON_UTF8_TOO_LARGE | AJSON_UTF8_TOO_LARGE_1000};
+
+#define AJSON_UTF8_CONT_ANY                                                    \
+  (AJSON_UTF8_TOO_LONG | AJSON_UTF8_OVERLONG_2 | AJSON_UTF8_TWO_CONTS)
+
+static const uint8_t ajson_utf8_byte_2_high[16] = {
+    AJSON_UTF8_TOO_SHORT,
+    AJSON_UTF8_TOO_SHORT,
+    AJSON_UTF8_TOO_SHORT,
+    AJSON_UTF8_TOO_SHORT,
+    AJSON_UTF8_TOO_SHORT,
+    AJSON_UTF8_TOO_SHORT,
+    AJSON_UTF8_TOO_SHORT,
+    AJSON_UTF8_TOO_SHORT,
+    AJSON_UTF8_CONT_ANY | AJSON_UTF8_OVERLONG_3 | AJSON_UTF8_TOO_LARGE_1000 |
+        AJSON_UTF8_OVERLONG_4,
+    AJSON_UTF8_CONT_ANY | AJSON_UTF8_OVERLONG_3 | AJSON_UTF8_TOO_LARGE,
+    AJSON_UTF8_CONT_ANY | AJSON_UTF8_SURROGATE | AJSON_UTF8_TOO_LARGE,
+    AJSON_UTF8_CONT_ANY | AJSON_UTF8_SURROGATE | AJSON_UTF8_TOO_LARGE,
+    AJSON_UTF8_TOO_SHORT,
+    AJSON_UTF8_TOO_SHORT,
+    AJSON_UTF8_TOO_SHORT,
+    AJSON_UTF8_TOO_SHORT};
+
+#if defined(AJSON_SIMD_X86)
+AJSON_TARGET("sse4.2")
+static inline __m128i ajson_utf8_check_sse42(__m128i input, __m128i prev) {
+  const __m128i b1h =
+      _mm_loadu_si128((const __m128i *)ajson_utf8_byte_1_high);
+  const __m128i b1l = _mm_loadu_si128((const __m128i *)ajson_utf8_byte_1_low);
+  const __m128i b2h =
+      _mm_loadu_si128((const __m128i *)ajson_utf8_byte_2_high);
+  const __m128i nibble = _mm_set1_epi8(0x0F);
+  __m128i prev1 = _mm_alignr_epi8(input, prev, 15);
+  __m128i sc = _mm_and_si128(
+      _mm_and_si128(
+          _mm_shuffle_epi8(b1h,
+                           _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+          _mm_shuffle_epi8(b1l, _mm_and_si128(prev1, nibble))),
+      _mm_shuffle_epi8(b2h, _mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+  __m128i third = _mm_subs_epu8(_mm_alignr_epi8(input, prev, 14),
+                                _mm_set1_epi8((char)(0xE0 - 0x80)));
+  __m128i fourth = _mm_subs_epu8(_mm_alignr_epi8(input, prev, 13),
+                                 _mm_set1_epi8((char)(0xF0 - 0x80)));
+  __m128i must23 = _mm_and_si128(_mm_or_si128(third, fourth),
+                                 _mm_set1_epi8((char)0x80));
+  return _mm_xor_si128(must23, sc);
+}
+
+AJSON_TARGET("sse4.2")
+static bool ajson_utf8_valid_sse42(const char *s, size_t length) {
+  __m128i prev = _mm_setzero_si128();
+  __m128i error = _mm_setzero_si128();
+  bool prev_ascii = true;
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i input = _mm_loadu_si128((const __m128i *)(s + i));
+    bool ascii = !_mm_movemask_epi8(input);
+    if (!ascii || !prev_ascii)
+      error = _mm_or_si128(error, ajson_utf8_check_sse42(input, prev));
+    prev = input;
+    prev_ascii = ascii;
+  }
+  if (i < length) {
+    char tail[16];
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, s + i, length - i);
+    __m128i input = _mm_loadu_si128((const __m128i *)tail);
+    error = _mm_or_si128(error, ajson_utf8_check_sse42(input, prev));
+    prev = input;
+    prev_ascii = false;
+  }
+  if (!prev_ascii)
+    error = _mm_or_si128(error,
+                         ajson_utf8_check_sse42(_mm_setzero_si128(), prev));
+  return _mm_testz_si128(error, error);
+}
+
+AJSON_TARGET("avx2")
+static inline __m256i ajson_utf8_check_avx2(__m256i input, __m256i prev) {
+  const __m256i b1h = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128((const __m128i *)ajson_utf8_byte_1_high));
+  const __m256i b1l = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128((const __m128i *)ajson_utf8_byte_1_low));
+  const __m256i b2h = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128((const __m128i *)ajson_utf8_byte_2_high));
+  const __m256i nibble = _mm256_set1_epi8(0x0F);
+  /* the upper lane of prev followed by the lower lane of input */
+  __m256i shifted = _mm256_permute2x128_si256(prev, input, 0x21);
+  __m256i prev1 = _mm256_alignr_epi8(input, shifted, 15);
+  __m256i sc = _mm256_and_si256(
+      _mm256_and_si256(
+          _mm256_shuffle_epi8(
+              b1h, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+          _mm256_shuffle_epi8(b1l, _mm256_and_si256(prev1, nibble))),
+      _mm256_shuffle_epi8(
+          b2h, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+  __m256i third = _mm256_subs_epu8(_mm256_alignr_epi8(input, shifted, 14),
+                                   _mm256_set1_epi8((char)(0xE0 - 0x80)));
+  __m256i fourth = _mm256_subs_epu8(_mm256_alignr_epi8(input, shifted, 13),
+                                    _mm256_set1_epi8((char)(0xF0 - 0x80)));
+  __m256i must23 = _mm256_and_si256(_mm256_or_si256(third, fourth),
+                                    _mm256_set1_epi8((char)0x80));
+  return _mm256_xor_si256(must23, sc);
+}
+
+AJSON_TARGET("avx2")
+static bool ajson_utf8_valid_avx2(const char *s, size_t length) {
+  __m256i prev = _mm256_setzero_si256();
+  __m256i error = _mm256_setzero_si256();
+  bool prev_ascii = true;
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i input = _mm256_loadu_si256((const __m256i *)(s + i));
+    bool ascii = !_mm256_movemask_epi8(input);
+    if (!ascii || !prev_ascii)
+      error = _mm256_or_si256(error, ajson_utf8_check_avx2(input, prev));
+    prev = input;
+    prev_ascii = ascii;
+  }
+  if (i < length) {
+    char tail[32];
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, s + i, length - i);
+    __m256i input = _mm256_loadu_si256((const __m256i *)tail);
+    error = _mm256_or_si256(error, ajson_utf8_check_avx2(input, prev));
+    prev = input;
+    prev_ascii = false;
+  }
+  if (!prev_ascii)
+    error = _mm256_or_si256(
+        error, ajson_utf8_check_avx2(_mm256_setzero_si256(), prev));
+  return _mm256_testz_si256(error, error);
+}
+#elif defined(AJSON_SIMD_NEON)
+static inline uint8x16_t ajson_utf8_check_neon(uint8x16_t input,
+                                               uint8x16_t prev) {
+  const uint8x16_t b1h = vld1q_u8(ajson_utf8_byte_1_high);
+  const uint8x16_t b1l = vld1q_u8(ajson_utf8_byte_1_low);
+  const uint8x16_t b2h = vld1q_u8(ajson_utf8_byte_2_high);
+  uint8x16_t prev1 = vextq_u8(prev, input, 15);
+  uint8x16_t sc =
+      vandq_u8(vandq_u8(vqtbl1q_u8(b1h, vshrq_n_u8(prev1, 4)),
+                        vqtbl1q_u8(b1l, vandq_u8(prev1, vdupq_n_u8(0x0F)))),
+               vqtbl1q_u8(b2h, vshrq_n_u8(input, 4)));
+  uint8x16_t third =
+      vqsubq_u8(vextq_u8(prev, input, 14), vdupq_n_u8(0xE0 - 0x80));
+  uint8x16_t fourth =
+      vqsubq_u8(vextq_u8(prev, input, 13), vdupq_n_u8(0xF0 - 0x80));
+  uint8x16_t must23 = vandq_u8(vorrq_u8(third, fourth), vdupq_n_u8(0x80));
+  return veorq_u8(must23, sc);
+}
+
+static bool ajson_utf8_valid_neon(const char *s, size_t length) {
+  uint8x16_t prev = vdupq_n_u8(0);
+  uint8x16_t error = vdupq_n_u8(0);
+  bool prev_ascii = true;
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    uint8x16_t input = vld1q_u8((const uint8_t *)s + i);
+    bool ascii = vmaxvq_u8(input) < 0x80;
+    if (!ascii || !prev_ascii)
+      error = vorrq_u8(error, ajson_utf8_check_neon(input, prev));
+    prev = input;
+    prev_ascii = ascii;
+  }
+  if (i < length) {
+    uint8_t tail[16];
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, s + i, length - i);
+    uint8x16_t input = vld1q_u8(tail);
+    error = vorrq_u8(error, ajson_utf8_check_neon(input, prev));
+    prev = input;
+    prev_ascii = false;
+  }
+  if (!prev_ascii)
+    error = vorrq_u8(error, ajson_utf8_check_neon(vdupq_n_u8(0), prev));
+  return vmaxvq_u8(error) == 0;
+}
+#endif
+
+/* The tables are 16 entries wide, so the AVX-512 level uses the AVX2
+   kernel. */
+void _ajson_utf8_select(ajson_simd_kernels_t *k, ajson_simd_t level) {
+  k->utf8_valid = ajson_utf8_valid_scalar;
+#if defined(AJSON_SIMD_X86)
+  if (level == AJSON_SIMD_AVX512 || level == AJSON_SIMD_AVX2)
+    k->utf8_valid = ajson_utf8_valid_avx2;
+  else if (level == AJSON_SIMD_SSE42)
+    k->utf8_valid = ajson_utf8_valid_sse42;
+#elif defined(AJSON_SIMD_NEON)
+  if (level == AJSON_SIMD_NEON)
+    k->utf8_valid = ajson_utf8_valid_neon;
+#endif
+}
+
+size_t _ajson_utf8_check(const char *s, size_t length) {
+  /* most keys and strings are short, so the kernel is only used for longer
+     ones */
+  if (length >= 16 && _ajson_simd_kernels()->utf8_valid(s, length))
+    return length;
+  return ajson_utf8_scalar((const unsigned char *)s, length);
+}
@@ -0,0 +1,27 @@
+/*
+Copyright 2019 Andy Curtis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _ajson_utf8_H
+#define _ajson_utf8_H
+
+#include <stddef.h>
+
+/* Validates the UTF-8 of a key or string (AJSON_PARSE_VALIDATE_UTF8).
+   Returns length if s is valid, otherwise the offset of the first invalid
+   sequence. */
+size_t _ajson_utf8_check(const char *s, size_t length);
+
+#endif